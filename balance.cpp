@@ -0,0 +1,163 @@
+#include <mpi.h>
+#include <math.h>
+#include <algorithm>
+#include "kmeans.h"
+
+#define DAMPING         0.5     // share of the gap to the ideal split closed per rebalance, so it never oscillates
+#define MIN_MOVE        0.01    // moves below this share of an even shard are not worth the traffic
+
+LoadBalancer::LoadBalancer(const DataFrame &data, unsigned int *point_clusters, unsigned int dimension, int every, MPI_Comm comm)
+    : data(data), point_clusters(point_clusters), dimension(dimension), every(every), comm(comm) {
+    MPI_Comm_size(comm, &ranks);
+    MPI_Comm_rank(comm, &rank);
+
+    // The points of all ranks are numbered in rank order, every rank always owns one contiguous range of them
+    long long count = data.size();
+    std::vector<long long> counts(ranks);
+    MPI_Allgather(&count, 1, MPI_LONG_LONG_INT, counts.data(), 1, MPI_LONG_LONG_INT, comm);
+    loaded.assign(ranks + 1, 0);
+    for (int other = 0; other < ranks; other++) {
+        loaded[other + 1] = loaded[other] + counts[other];
+    }
+    current = loaded;
+
+    // Balanced runs work on a copy they can hand rows out of, the loaded shard is left alone
+    if (every > 0) {
+        const size_t length = data.size() * dimension;
+        if (data.single()) {
+            working = DataFrame(std::vector<float>(data.single_data(), data.single_data() + length), dimension);
+        } else {
+            working = DataFrame(std::vector<double>(data.data(), data.data() + length), dimension);
+        }
+        working_labels.assign(point_clusters, point_clusters + data.size());
+    }
+}
+
+const DataFrame &LoadBalancer::rows() const {
+    return (every > 0)? working: data;
+}
+
+unsigned int *LoadBalancer::labels() {
+    return (every > 0)? working_labels.data(): point_clusters;
+}
+
+void LoadBalancer::record(double assign_seconds, double wait_seconds, double iteration_seconds) {
+    assign_time += assign_seconds;
+    wait_time += wait_seconds;
+    loop_time += iteration_seconds;
+}
+
+// Rows [from[r], from[r + 1]) of rank r go where [to[r], to[r + 1]) says, along with their labels.
+// Both splits keep the rank order, so rows only cross the boundaries that moved.
+static void counts_between(const std::vector<long long> &from, const std::vector<long long> &to, int rank, int ranks,
+                           std::vector<int> &send, std::vector<int> &send_at, std::vector<int> &receive, std::vector<int> &receive_at) {
+    for (int other = 0; other < ranks; other++) {
+        send[other] = std::max(0LL, std::min(from[rank + 1], to[other + 1]) - std::max(from[rank], to[other]));
+        receive[other] = std::max(0LL, std::min(to[rank + 1], from[other + 1]) - std::max(to[rank], from[other]));
+    }
+
+    send_at[0] = receive_at[0] = 0;
+    for (int other = 1; other < ranks; other++) {
+        send_at[other] = send_at[other - 1] + send[other - 1];
+        receive_at[other] = receive_at[other - 1] + receive[other - 1];
+    }
+}
+
+bool LoadBalancer::rebalance(int iteration) {
+    if (every <= 0 || (iteration + 1) % every != 0) {
+        return false;
+    }
+
+    // Throughput of every rank over the last iterations, points assigned per second
+    double measured[2] = { (double) (current[rank + 1] - current[rank]), assign_time };
+    std::vector<double> all(2 * ranks);
+    MPI_Allgather(measured, 2, MPI_DOUBLE, all.data(), 2, MPI_DOUBLE, comm);
+    assign_time = 0;
+
+    double total_rate = 0, known_rate = 0;
+    int known = 0;
+    for (int other = 0; other < ranks; other++) {
+        if (all[2 * other] > 0 && all[2 * other + 1] > 0) {
+            known_rate += all[2 * other] / all[2 * other + 1];
+            known += 1;
+        }
+    }
+    if (known == 0) {
+        return false;
+    }
+
+    // Ranks without rows or timings are assumed to run at the average rate
+    std::vector<double> rates(ranks);
+    for (int other = 0; other < ranks; other++) {
+        const bool measured_rate = (all[2 * other] > 0 && all[2 * other + 1] > 0);
+        rates[other] = measured_rate? all[2 * other] / all[2 * other + 1]: known_rate / known;
+        total_rate += rates[other];
+    }
+
+    // Every rank computes the same split from the same numbers, so no decision has to be broadcast
+    const long long points = current[ranks];
+    std::vector<long long> next(ranks + 1, 0);
+    double ideal_boundary = 0;
+    long long largest_move = 0;
+    for (int other = 0; other < ranks; other++) {
+        ideal_boundary += points * rates[other] / total_rate;
+        const double boundary = current[other + 1] + DAMPING * (ideal_boundary - current[other + 1]);
+        next[other + 1] = (other == ranks - 1)? points: std::min(points, std::max(next[other], llround(boundary)));
+        largest_move = std::max(largest_move, std::abs(next[other + 1] - current[other + 1]));
+    }
+
+    if (largest_move < std::max(1.0, MIN_MOVE * points / ranks)) {
+        return false;
+    }
+
+    std::vector<int> send(ranks), send_at(ranks), receive(ranks), receive_at(ranks);
+    counts_between(current, next, rank, ranks, send, send_at, receive, receive_at);
+
+    MPI_Datatype row_type;
+    MPI_Type_contiguous(dimension, working.single()? MPI_FLOAT: MPI_DOUBLE, &row_type);
+    MPI_Type_commit(&row_type);
+
+    const long long count = next[rank + 1] - next[rank];
+    std::vector<unsigned int> labels(count);
+    MPI_Alltoallv(working_labels.data(), send.data(), send_at.data(), MPI_UNSIGNED,
+                  labels.data(), receive.data(), receive_at.data(), MPI_UNSIGNED, comm);
+
+    if (working.single()) {
+        std::vector<float> values(count * dimension);
+        MPI_Alltoallv(working.single_data(), send.data(), send_at.data(), row_type,
+                      values.data(), receive.data(), receive_at.data(), row_type, comm);
+        working = DataFrame(std::move(values), dimension);
+    } else {
+        std::vector<double> values(count * dimension);
+        MPI_Alltoallv(working.data(), send.data(), send_at.data(), row_type,
+                      values.data(), receive.data(), receive_at.data(), row_type, comm);
+        working = DataFrame(std::move(values), dimension);
+    }
+
+    MPI_Type_free(&row_type);
+    working_labels.swap(labels);
+    current.swap(next);
+    moves += 1;
+
+    return true;
+}
+
+void LoadBalancer::finish(KMeansSummary &summary) {
+    // The labels go back to the ranks that loaded their points, so the shards are written in input order
+    if (every > 0) {
+        std::vector<int> send(ranks), send_at(ranks), receive(ranks), receive_at(ranks);
+        counts_between(current, loaded, rank, ranks, send, send_at, receive, receive_at);
+        MPI_Alltoallv(working_labels.data(), send.data(), send_at.data(), MPI_UNSIGNED,
+                      point_clusters, receive.data(), receive_at.data(), MPI_UNSIGNED, comm);
+    }
+
+    // Share of the loop every rank spent waiting in the reduction for the slowest one
+    double fraction = (loop_time > 0)? wait_time / loop_time: 0;
+    double fractions[2] = { fraction, fraction };
+    MPI_Allreduce(MPI_IN_PLACE, &fractions[0], 1, MPI_DOUBLE, MPI_SUM, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &fractions[1], 1, MPI_DOUBLE, MPI_MAX, comm);
+
+    summary.wait_fraction = fractions[0] / ranks;
+    summary.max_wait_fraction = fractions[1];
+    summary.rebalances = moves;
+}
@@ -0,0 +1,346 @@
+#include <omp.h>
+#include <mpi.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "kmeans.h"
+
+#define MASTER      0
+#define BLOBS       16          // true clusters of the synthetic data
+#define SPREAD      1000000.0   // blob centres fall in [0, SPREAD) on every axis
+
+struct Result {
+    std::string command, algorithm, order;
+    long long points;
+    unsigned int k, dimension;
+    int threads, ranks, iterations, repeats, sort_every;
+    double median, p95, points_per_second, evaluations_per_second;
+};
+
+static void usage(const char *progname) {
+    fprintf(stderr, "usage: %s [-h] [-N SIZES] [-c CLUSTERS] [-d DIMENSIONS] [-t THREADS] [-e COMMANDS] [-a ALGORITHMS]\n", progname);
+    fprintf(stderr, "          [-i ITERATIONS] [-r REPEATS] [-w WARMUP] [-I INIT] [-s SEED] [--orders ORDERS] [--sort-every ITERATIONS]\n");
+    fprintf(stderr, "          [-o OUTPUT] [--json]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Every list is comma separated and the benchmark runs their cross product.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "optional arguments:\n");
+    fprintf(stderr, "  -h --help                   show this help message and exit\n");
+    fprintf(stderr, "  -N --sizes      <SIZES>     points of the synthetic datasets (default 100000)\n");
+    fprintf(stderr, "  -c --clusters   <CLUSTERS>  clusters to look for (default 16)\n");
+    fprintf(stderr, "  -d --dimensions <DIMS>      dimension of the points (default 2)\n");
+    fprintf(stderr, "  -t --threads    <THREADS>   omp threads of \"omp\" and \"hybrid\" (default 1,2,4)\n");
+    fprintf(stderr, "  -e --commands   <COMMANDS>  engines, \"serial\", \"omp\", \"mpi\" and \"hybrid\" (default all)\n");
+    fprintf(stderr, "  -a --algorithms <NAMES>     algorithms of every engine (default lloyd)\n");
+    fprintf(stderr, "  -i --max-iter   <ITERATIONS> iterations of every run, the stopping rules are off (default 20)\n");
+    fprintf(stderr, "  -r --repeats    <REPEATS>   timed runs per configuration (default 5)\n");
+    fprintf(stderr, "  -w --warmup     <WARMUP>    untimed runs before them (default 1)\n");
+    fprintf(stderr, "  -I --init       <INIT>      seeding of every run (default \"random\", the cheapest)\n");
+    fprintf(stderr, "  -s --seed       <SEED>      seed of the data and of the centroids (default 1)\n");
+    fprintf(stderr, "  --orders        <ORDERS>    row orders, \"none\", \"morton\" and \"hilbert\" (default none), the rows are\n");
+    fprintf(stderr, "                              sorted once per order before the timed runs\n");
+    fprintf(stderr, "  --sort-every    <ITERATIONS> \"lloyd\" groups the rows by cluster every <ITERATIONS> (default 0, off)\n");
+    fprintf(stderr, "  -o --output     <FILENAME>  write the results to <FILENAME> instead of stdout\n");
+    fprintf(stderr, "  --json                      write JSON instead of CSV\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Run it under mpirun for \"mpi\" and \"hybrid\", \"serial\" and \"omp\" then run on MASTER alone.\n");
+}
+
+static std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> names;
+    size_t start = 0;
+    while (start <= list.size()) {
+        const size_t comma = std::min(list.find(',', start), list.size());
+        if (comma > start) {
+            names.push_back(list.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return names;
+}
+
+static std::vector<long long> split_numbers(const std::string &list) {
+    std::vector<long long> numbers;
+    for (const std::string &name : split(list)) {
+        numbers.push_back(std::stoll(name));
+    }
+    return numbers;
+}
+
+static uint64_t splitmix(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double uniform(uint64_t &state) {
+    return (splitmix(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Rows [offset, offset + size) of BLOBS Gaussian blobs, every row only depends on its global index,
+// so a shard holds exactly the rows the whole dataset has at its place
+static DataFrame synthetic(long long offset, long long size, long long total, unsigned int dimension, unsigned long long seed) {
+    std::vector<double> centres(BLOBS * dimension);
+    uint64_t state = seed;
+    for (double &centre : centres) {
+        centre = uniform(state) * SPREAD;
+    }
+
+    DataFrame data(size, dimension);
+    for (long long row = 0; row < size; row++) {
+        const long long index = offset + row;
+        const double *centre = &centres[(index % BLOBS) * dimension];
+        state = seed ^ (uint64_t) index * 0xd1b54a32d192ed03ULL;
+        for (unsigned int d = 0; d < dimension; d++) {
+            // Box-Muller, the blobs overlap a little so the runs do real work
+            const double radius = sqrt(-2.0 * log(1.0 - uniform(state)));
+            data[row][d] = centre[d] + radius * cos(2 * M_PI * uniform(state)) * SPREAD / (4 * BLOBS);
+        }
+    }
+
+    data.shard(offset, total);
+    return data;
+}
+
+// Nearest-rank percentile of the timings
+static double percentile(std::vector<double> times, double fraction) {
+    std::sort(times.begin(), times.end());
+    const size_t rank = (size_t) ceil(fraction * times.size());
+    return times[std::max<size_t>(rank, 1) - 1];
+}
+
+static void write_csv(FILE *fp, const std::vector<Result> &results) {
+    // The row order comes last, so the columns of older results keep their place
+    fprintf(fp, "command,algorithm,points,k,dimension,threads,ranks,iterations,repeats,median_s,p95_s,points_per_s,distance_evals_per_s,order,sort_every\n");
+    for (const Result &result : results) {
+        fprintf(fp, "%s,%s,%lld,%u,%u,%d,%d,%d,%d,%.6f,%.6f,%.6e,%.6e,%s,%d\n",
+                result.command.c_str(), result.algorithm.c_str(), result.points, result.k, result.dimension, result.threads,
+                result.ranks, result.iterations, result.repeats, result.median, result.p95,
+                result.points_per_second, result.evaluations_per_second, result.order.c_str(), result.sort_every);
+    }
+}
+
+static void write_json(FILE *fp, const std::vector<Result> &results) {
+    fprintf(fp, "[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &result = results[i];
+        fprintf(fp, "  {\"command\": \"%s\", \"algorithm\": \"%s\", \"order\": \"%s\", \"sort_every\": %d, "
+                    "\"points\": %lld, \"k\": %u, \"dimension\": %u, "
+                    "\"threads\": %d, \"ranks\": %d, \"iterations\": %d, \"repeats\": %d, \"median_s\": %.6f, \"p95_s\": %.6f, "
+                    "\"points_per_s\": %.6e, \"distance_evals_per_s\": %.6e}%s\n",
+                result.command.c_str(), result.algorithm.c_str(), result.order.c_str(), result.sort_every, result.points,
+                result.k, result.dimension, result.threads, result.ranks, result.iterations, result.repeats, result.median,
+                result.p95, result.points_per_second, result.evaluations_per_second, (i + 1 < results.size())? ",": "");
+    }
+    fprintf(fp, "]\n");
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"help"      , no_argument      , NULL, 'h'},
+        {"sizes"     , required_argument, NULL, 'N'},
+        {"clusters"  , required_argument, NULL, 'c'},
+        {"dimensions", required_argument, NULL, 'd'},
+        {"threads"   , required_argument, NULL, 't'},
+        {"commands"  , required_argument, NULL, 'e'},
+        {"algorithms", required_argument, NULL, 'a'},
+        {"max-iter"  , required_argument, NULL, 'i'},
+        {"repeats"   , required_argument, NULL, 'r'},
+        {"warmup"    , required_argument, NULL, 'w'},
+        {"init"      , required_argument, NULL, 'I'},
+        {"seed"      , required_argument, NULL, 's'},
+        {"output"    , required_argument, NULL, 'o'},
+        {"json"      , no_argument      , NULL, 'J'},
+        {"orders"    , required_argument, NULL, 'H'},
+        {"sort-every", required_argument, NULL, 'G'},
+        {NULL        , 0                , NULL,  0 }
+    };
+
+    int opt;
+    std::vector<long long> sizes = { 100000 }, clusters = { 16 }, dimensions = { 2 }, thread_counts = { 1, 2, 4 };
+    std::vector<std::string> commands = { "serial", "omp", "mpi", "hybrid" }, algorithms = { "lloyd" }, orders = { "none" };
+    int iterations = 20, repeats = 5, warmup = 1, sort_every = 0;
+    unsigned long long seed = 1;
+    std::string init = "random";
+    std::string output;
+    bool json = false;
+
+    while ((opt = getopt_long(argc, argv, "N:c:d:t:e:a:i:r:w:I:s:o:h", long_options, NULL)) != EOF) {
+        switch (opt) {
+            case 'N': sizes         = split_numbers(optarg); break;
+            case 'c': clusters      = split_numbers(optarg); break;
+            case 'd': dimensions    = split_numbers(optarg); break;
+            case 't': thread_counts = split_numbers(optarg); break;
+            case 'e': commands      = split(optarg);         break;
+            case 'a': algorithms    = split(optarg);         break;
+            case 'i': iterations    = std::stoi(optarg);     break;
+            case 'r': repeats       = std::stoi(optarg);     break;
+            case 'w': warmup        = std::stoi(optarg);     break;
+            case 'I': init          = std::string(optarg);   break;
+            case 's': seed          = std::stoull(optarg);   break;
+            case 'o': output        = std::string(optarg);   break;
+            case 'J': json          = true;                  break;
+            case 'H': orders        = split(optarg);         break;
+            case 'G': sort_every    = std::stoi(optarg);     break;
+            case 'h': usage(argv[0]); exit(1);
+            default : usage(argv[0]); exit(1);
+        }
+    }
+
+    if (repeats < 1) {
+        fprintf(stderr, "at least one repeat is needed.\n");
+        exit(1);
+    }
+
+    for (const std::string &order : orders) {
+        if (order != "none" && order != "morton" && order != "hilbert") {
+            fprintf(stderr, "order \"%s\" is not available.\n", order.c_str());
+            exit(1);
+        }
+    }
+
+    for (const std::string &command : commands) {
+        for (const std::string &algorithm : algorithms) {
+            if (find_engine(algorithm, command) == NULL) {
+                fprintf(stderr, "algorithm \"%s\" is not available for the \"%s\" command.\n", algorithm.c_str(), command.c_str());
+                exit(1);
+            }
+        }
+    }
+
+    int provided, world_size, world_rank;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_MULTIPLE, &provided);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    // Fixed work per run, so the timings of different engines compare
+    KMeansOptions options;
+    options.max_iterations = iterations;
+    options.tolerance = -1;
+    options.min_changed = -1;
+    options.inertia_tolerance = -1;
+    options.init = init;
+    options.seed = seed;
+    options.sort_every = sort_every;
+
+    // Thread counts beyond what OpenMP allows would only repeat the largest one
+    const int max_threads = omp_get_max_threads();
+    for (long long &threads : thread_counts) {
+        threads = std::min<long long>(threads, max_threads);
+    }
+    thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+
+    std::vector<Result> results;
+
+    for (long long size : sizes) {
+        for (long long dimension : dimensions) {
+            // MASTER keeps the whole dataset for "serial" and "omp", every rank its shard for the others
+            const long long offset = size * world_rank / world_size, end = size * (world_rank + 1) / world_size;
+            DataFrame shard = synthetic(offset, end - offset, size, dimension, seed);
+            const bool local = std::count(commands.begin(), commands.end(), "serial") + std::count(commands.begin(), commands.end(), "omp") > 0;
+            DataFrame whole = (world_rank == MASTER && local)? synthetic(0, size, size, dimension, seed): DataFrame();
+            std::vector<unsigned int> point_clusters(std::max(shard.size(), whole.size()));
+
+            for (const std::string &order : orders) {
+                // The rows are sorted once per order before the timed runs, like a preprocessing step
+                DataFrame sorted_shard, sorted_whole;
+                if (order != "none") {
+                    sorted_shard = permute_rows(shard, curve_order(shard, order, true), true);
+                    sorted_whole = permute_rows(whole, curve_order(whole, order, true), true);
+                }
+                const DataFrame &ordered_shard = (order == "none")? shard: sorted_shard;
+                const DataFrame &ordered_whole = (order == "none")? whole: sorted_whole;
+                for (long long k : clusters) {
+                    for (const std::string &command : commands) {
+                        for (const std::string &algorithm : algorithms) {
+                            const bool distributed = (command == "mpi" || command == "hybrid");
+                            const bool parallel = (command == "omp" || command == "hybrid");
+                            const KMeans kmeans = find_engine(algorithm, command);
+                            const DataFrame &data = distributed? ordered_shard: ordered_whole;
+
+                            for (long long threads : parallel? thread_counts: std::vector<long long>{ 1 }) {
+                                omp_set_num_threads(threads);
+
+                                std::vector<double> times;
+                                long long evaluations = 0;
+                                for (int run = 0; run < warmup + repeats; run++) {
+                                    struct timespec starttime, endtime;
+                                    KMeansSummary summary;
+
+                                    MPI_Barrier(MPI_COMM_WORLD);
+                                    clock_gettime(CLOCK_MONOTONIC, &starttime);
+                                    if (distributed || world_rank == MASTER) {
+                                        kmeans(data, k, point_clusters.data(), options, summary);
+                                    }
+                                    clock_gettime(CLOCK_MONOTONIC, &endtime);
+
+                                    // A distributed run lasts as long as its slowest rank
+                                    double elapsed = calculate_time(starttime, endtime);
+                                    if (distributed) {
+                                        MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+                                    }
+
+                                    if (run >= warmup) {
+                                        times.push_back(elapsed);
+                                        evaluations = summary.distance_evaluations;
+                                    }
+                                }
+
+                                if (world_rank == MASTER) {
+                                    Result result;
+                                    result.command = command;
+                                    result.algorithm = algorithm;
+                                    result.order = order;
+                                    result.sort_every = sort_every;
+                                    result.points = size;
+                                    result.k = k;
+                                    result.dimension = dimension;
+                                    result.threads = threads;
+                                    result.ranks = distributed? world_size: 1;
+                                    result.iterations = iterations;
+                                    result.repeats = repeats;
+                                    result.median = percentile(times, 0.5);
+                                    result.p95 = percentile(times, 0.95);
+                                    result.points_per_second = (double) size * iterations / result.median;
+                                    result.evaluations_per_second = evaluations / result.median;
+                                    results.push_back(result);
+
+                                    fprintf(stderr, "%-7s %-9s %-7s N=%-9lld k=%-5lld d=%-3lld threads=%-3d ranks=%-3d median %.6f s, p95 %.6f s\n",
+                                            command.c_str(), algorithm.c_str(), order.c_str(), size, k, dimension, result.threads, result.ranks,
+                                            result.median, result.p95);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (world_rank == MASTER) {
+        FILE *fp = output.empty()? stdout: fopen(output.c_str(), "w");
+        if (fp == NULL) {
+            perror("bench error");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        if (json) {
+            write_json(fp, results);
+        } else {
+            write_csv(fp, results);
+        }
+
+        if (fp != stdout) {
+            fclose(fp);
+        }
+    }
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,250 @@
+#include <mpi.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <filesystem>
+#include <string.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+#define MASTER          0
+#define MODE            0775
+#define SUMMARY_SLOTS   6   // iterations, converged, changed, inertia, shift, distance evaluations
+
+// Layout after the header, whose reserved words hold the next iteration, the extra values and the RNG states:
+// k * dimension means, the summary, the extra values, then per rank the length and text of its RNG state
+#define NEXT_ITERATION  0
+#define EXTRA_VALUES    1
+#define RNG_STATES      2
+
+static std::filesystem::path checkpoint_path(const std::string &filename) {
+    return std::filesystem::path("outputs") / std::filesystem::path(filename);
+}
+
+Checkpoint::Checkpoint(const KMeansOptions &options, unsigned int k, unsigned int dimension, bool distributed)
+    : options(options), k(k), dimension(dimension), distributed(distributed) {
+    if (distributed) {
+        MPI_Comm_rank(options.comm, &rank);
+    }
+}
+
+// The last checkpoint of the run is finished before the engine returns
+Checkpoint::~Checkpoint() {
+    if (writer.valid()) {
+        writer.wait();
+    }
+}
+
+int Checkpoint::resume(double *means, KMeansSummary &summary, std::vector<double> *extra, std::mt19937_64 *rng) {
+    if (!options.resume || options.checkpoint.empty()) {
+        return -1;
+    }
+
+    // The master reads the file and every rank gets the same bytes
+    std::vector<char> buffer;
+    if (rank == MASTER) {
+        std::ifstream fp(checkpoint_path(options.checkpoint), std::ifstream::in | std::ifstream::binary);
+        if (fp.is_open()) {
+            buffer.assign(std::istreambuf_iterator<char>(fp), std::istreambuf_iterator<char>());
+        }
+    }
+
+    unsigned long long length = buffer.size();
+    if (distributed) {
+        MPI_Bcast(&length, 1, MPI_UNSIGNED_LONG_LONG, MASTER, options.comm);
+        buffer.resize(length);
+        MPI_Bcast(buffer.data(), length, MPI_CHAR, MASTER, options.comm);
+    }
+
+    // A missing or foreign checkpoint starts the run over, so a job can always be launched with --resume
+    BinaryHeader header;
+    const size_t extra_values = (extra != NULL)? extra->size(): 0;
+    const size_t values = (size_t) k * dimension + SUMMARY_SLOTS + extra_values;
+    if (length < sizeof(header) + values * sizeof(double)) {
+        if (rank == MASTER) {
+            fprintf(stderr, "resume: no checkpoint in outputs/%s, starting over\n", options.checkpoint.c_str());
+        }
+        return -1;
+    }
+
+    memcpy(&header, buffer.data(), sizeof(header));
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION ||
+        header.count != k || header.dimension != dimension || header.reserved[EXTRA_VALUES] != extra_values) {
+        if (rank == MASTER) {
+            fprintf(stderr, "resume: outputs/%s is not a checkpoint of this run, starting over\n", options.checkpoint.c_str());
+        }
+        return -1;
+    }
+
+    // Every rank picks its own RNG state, which only lines up when the run has as many ranks as before. The sizes
+    // come from the file, so each one is checked against what is left of it before anything is restored.
+    int ranks = 1;
+    if (distributed) {
+        MPI_Comm_size(options.comm, &ranks);
+    }
+
+    const bool states = (rng != NULL && header.reserved[RNG_STATES] == (uint32_t) ranks);
+    std::string state;
+    if (states) {
+        const char *cursor = buffer.data() + sizeof(header) + values * sizeof(double);
+        const char *end = buffer.data() + length;
+        for (int other = 0; other < ranks; other++) {
+            uint64_t size;
+            if ((size_t) (end - cursor) < sizeof(size)) {
+                cursor = NULL;
+                break;
+            }
+            memcpy(&size, cursor, sizeof(size));
+            cursor += sizeof(size);
+            if (size > (uint64_t) (end - cursor)) {
+                cursor = NULL;
+                break;
+            }
+            if (other == rank) {
+                state.assign(cursor, size);
+            }
+            cursor += size;
+        }
+
+        if (cursor == NULL) {
+            if (rank == MASTER) {
+                fprintf(stderr, "resume: outputs/%s is truncated, starting over\n", options.checkpoint.c_str());
+            }
+            return -1;
+        }
+    } else if (rng != NULL && rank == MASTER) {
+        fprintf(stderr, "resume: outputs/%s was written by %u ranks, drawing fresh random numbers\n",
+                options.checkpoint.c_str(), header.reserved[RNG_STATES]);
+    }
+
+    const double *stored = (const double*) (buffer.data() + sizeof(header));
+    std::copy_n(stored, (size_t) k * dimension, means);
+    stored += (size_t) k * dimension;
+
+    summary.iterations = stored[0];
+    summary.converged = false;
+    summary.changed = -1;   // the labels are not saved, so the first resumed iteration cannot count changes
+    summary.inertia = stored[3];
+    summary.shift = stored[4];
+    summary.distance_evaluations = stored[5];
+    stored += SUMMARY_SLOTS;
+
+    if (extra != NULL) {
+        std::copy_n(stored, extra_values, extra->begin());
+    }
+
+    if (states) {
+        std::istringstream(state) >> *rng;
+    }
+
+    return header.reserved[NEXT_ITERATION];
+}
+
+void Checkpoint::save(int next, const double *means, const KMeansSummary &summary, const std::vector<double> *extra,
+                      const std::mt19937_64 *rng) {
+    if (options.checkpoint.empty() || options.checkpoint_every <= 0 || next % options.checkpoint_every != 0) {
+        return;
+    }
+
+    // The RNG states of the ranks are gathered on the master, a few kilobytes each
+    std::vector<char> states;
+    int states_count = 0;
+    if (rng != NULL) {
+        std::ostringstream text;
+        text << *rng;
+        const std::string state = text.str();
+
+        if (distributed) {
+            int ranks, size = state.size();
+            MPI_Comm_size(options.comm, &ranks);
+            std::vector<int> sizes(ranks), displacements(ranks, 0);
+            MPI_Gather(&size, 1, MPI_INT, sizes.data(), 1, MPI_INT, MASTER, options.comm);
+
+            std::vector<char> gathered;
+            if (rank == MASTER) {
+                for (int other = 1; other < ranks; other++) {
+                    displacements[other] = displacements[other - 1] + sizes[other - 1];
+                }
+                gathered.resize(displacements[ranks - 1] + sizes[ranks - 1]);
+            }
+            MPI_Gatherv(state.data(), size, MPI_CHAR, gathered.data(), sizes.data(), displacements.data(), MPI_CHAR,
+                        MASTER, options.comm);
+
+            for (int other = 0; other < ranks && rank == MASTER; other++) {
+                const uint64_t length = sizes[other];
+                states.insert(states.end(), (const char*) &length, (const char*) &length + sizeof(length));
+                states.insert(states.end(), gathered.begin() + displacements[other], gathered.begin() + displacements[other] + sizes[other]);
+            }
+            states_count = ranks;
+        } else {
+            const uint64_t length = state.size();
+            states.insert(states.end(), (const char*) &length, (const char*) &length + sizeof(length));
+            states.insert(states.end(), state.begin(), state.end());
+            states_count = 1;
+        }
+    }
+
+    if (rank != MASTER) {
+        return;
+    }
+
+    // Still writing the previous one, skip rather than make the iteration wait
+    if (writer.valid() && writer.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return;
+    }
+    if (writer.valid()) {
+        writer.get();
+    }
+
+    const size_t extra_values = (extra != NULL)? extra->size(): 0;
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.dtype = DTYPE_FLOAT64;
+    header.count = k;
+    header.dimension = dimension;
+    header.reserved[NEXT_ITERATION] = next;
+    header.reserved[EXTRA_VALUES] = extra_values;
+    header.reserved[RNG_STATES] = states_count;
+
+    std::vector<char> buffer(sizeof(header) + ((size_t) k * dimension + SUMMARY_SLOTS + extra_values) * sizeof(double));
+    memcpy(buffer.data(), &header, sizeof(header));
+    double *stored = (double*) (buffer.data() + sizeof(header));
+    stored = std::copy_n(means, (size_t) k * dimension, stored);
+
+    const double status[SUMMARY_SLOTS] = { (double) summary.iterations, (double) summary.converged, (double) summary.changed,
+                                           summary.inertia, summary.shift, (double) summary.distance_evaluations };
+    stored = std::copy_n(status, SUMMARY_SLOTS, stored);
+    if (extra != NULL) {
+        std::copy_n(extra->begin(), extra_values, stored);
+    }
+    buffer.insert(buffer.end(), states.begin(), states.end());
+
+    // Written next to the old checkpoint and renamed over it, so a preemption never leaves half a file
+    const std::filesystem::path pathname = checkpoint_path(options.checkpoint);
+    writer = std::async(std::launch::async, [pathname, buffer = std::move(buffer)]() {
+        if (!std::filesystem::exists(pathname.parent_path())) {
+            mkdir(pathname.parent_path().c_str(), MODE);
+        }
+
+        std::filesystem::path temporary = pathname;
+        temporary += ".tmp";
+
+        std::ofstream fp(temporary, std::ofstream::out | std::ofstream::binary);
+        if (!fp.is_open() || !fp.write(buffer.data(), buffer.size())) {
+            perror("checkpoint error");
+            return -1;
+        }
+        fp.close();
+
+        std::error_code error;
+        std::filesystem::rename(temporary, pathname, error);
+        if (error) {
+            fprintf(stderr, "checkpoint error: %s\n", error.message().c_str());
+            return -1;
+        }
+        return 0;
+    });
+}
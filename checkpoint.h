@@ -0,0 +1,41 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <future>
+#include <random>
+#include <string>
+#include <vector>
+#include "kmeans.h"
+
+#define CHECKPOINT_MAGIC    "KMCHECKP"
+#define CHECKPOINT_VERSION  1
+
+// Iteration state of one engine run, written every options.checkpoint_every iterations into
+// outputs/<options.checkpoint> and read back with options.resume. Only the master of options.comm touches
+// the file: it serializes the state into a buffer and a background writer stores it, so the iteration loop
+// never waits on the disk. A save that comes while the previous one is still being written is skipped.
+class Checkpoint {
+public:
+    Checkpoint(const KMeansOptions &options, unsigned int k, unsigned int dimension, bool distributed);
+    ~Checkpoint();
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint &operator=(const Checkpoint&) = delete;
+
+    // Restore the centroids, the summary and whatever the engine adds, on every rank. Returns the iteration
+    // to continue from, or -1 when there is nothing to resume and the engine seeds as usual. <extra> must be
+    // the same on every rank, while every rank keeps its own <rng>.
+    int resume(double *means, KMeansSummary &summary, std::vector<double> *extra = NULL, std::mt19937_64 *rng = NULL);
+
+    // Called by every rank once iteration <next> - 1 is done, a no-op between checkpoints
+    void save(int next, const double *means, const KMeansSummary &summary, const std::vector<double> *extra = NULL,
+              const std::mt19937_64 *rng = NULL);
+
+private:
+    const KMeansOptions &options;
+    unsigned int k, dimension;
+    bool distributed;
+    int rank = 0;
+    std::future<int> writer;
+};
+
+#endif
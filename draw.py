@@ -20,13 +20,13 @@ if __name__ == '__main__':
     fig.suptitle('Before and After K-Means Clustering')
 
     # before
-    df = pd.read_csv(os.path.join('inputs', filename), delim_whitespace=True, header=None)
+    df = pd.read_csv(os.path.join('inputs', filename), delim_whitespace=True, header=None).iloc[:, :2]
     df.columns = ['x', 'y']
     sns.scatterplot(ax=ax[0], x=df['x'], y=df['y'])
     ax[0].set_title('Before Clustering')
 
     # after
-    df = pd.read_csv(os.path.join('outputs', f'{filename}.out'), delim_whitespace=True, header=None)
+    df = pd.read_csv(os.path.join('outputs', f'{filename}.out'), delim_whitespace=True, header=None).iloc[:, [0, 1, -1]]
     df.columns = ['x', 'y', 'cluster']
     sns.scatterplot(ax=ax[1], x=df['x'], y=df['y'], hue=df['cluster'], palette=sns.color_palette('hls', n_colors=clusters))
     ax[1].set_title('After Clustering')
@@ -0,0 +1,74 @@
+#include <mpi.h>
+#include <algorithm>
+#include "kmeans.h"
+
+RunningTotals::RunningTotals(unsigned int k, unsigned int dimension, int every, int first_iteration)
+    : k(k), dimension(dimension), every(every), first_iteration(first_iteration),
+      totals((every > 0)? (size_t) k * dimension + k: 0) {}
+
+void RunningTotals::apply(int iteration, double *reduced) {
+    if (every <= 0) {
+        return;
+    }
+
+    if (!full(iteration)) {
+        for (size_t i = 0; i < totals.size(); i++) {
+            reduced[i] += totals[i];
+        }
+    }
+    std::copy_n(reduced, totals.size(), totals.begin());
+}
+
+bool RunningTotals::exchange(const double *deltas, double *reduced, size_t extra, MPI_Comm comm) {
+    const size_t values = (size_t) k * dimension;
+    const double *counts = deltas + values;
+
+    // The per-iteration values lead, then one record per cluster whose points changed
+    records.assign(counts + k, counts + k + extra);
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        const double *sums = deltas + cluster * dimension;
+        if (counts[cluster] == 0 && std::all_of(sums, sums + dimension, [](double value) { return value == 0; })) {
+            continue;
+        }
+
+        records.push_back(cluster);
+        records.push_back(counts[cluster]);
+        records.insert(records.end(), sums, sums + dimension);
+    }
+
+    int size;
+    MPI_Comm_size(comm, &size);
+    const int length = records.size();
+    std::vector<int> lengths(size), displacements(size, 0);
+    MPI_Allgather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, comm);
+    for (int rank = 1; rank < size; rank++) {
+        displacements[rank] = displacements[rank - 1] + lengths[rank - 1];
+    }
+
+    // Every rank sees the same lengths, so they all fall back to the dense reduction together
+    const size_t total = (size_t) displacements[size - 1] + lengths[size - 1];
+    if (total >= values + k + extra) {
+        return false;
+    }
+
+    gathered.resize(total);
+    MPI_Allgatherv(records.data(), length, MPI_DOUBLE, gathered.data(), lengths.data(), displacements.data(), MPI_DOUBLE, comm);
+
+    std::fill(reduced, reduced + values + k + extra, 0.0);
+    for (int rank = 0; rank < size; rank++) {
+        const double *record = &gathered[displacements[rank]], *end = record + lengths[rank];
+        for (size_t slot = 0; slot < extra; slot++) {
+            reduced[values + k + slot] += record[slot];
+        }
+
+        for (record += extra; record < end; record += dimension + 2) {
+            const unsigned int cluster = record[0];
+            reduced[values + cluster] += record[1];
+            for (unsigned int d = 0; d < dimension; d++) {
+                reduced[cluster * dimension + d] += record[2 + d];
+            }
+        }
+    }
+
+    return true;
+}
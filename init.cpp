@@ -0,0 +1,239 @@
+#include <omp.h>
+#include <mpi.h>
+#include <random>
+#include <algorithm>
+#include <type_traits>
+#include "kmeans.h"
+
+#define MASTER      0
+#define ROUNDS      5   // sampling rounds of k-means||
+#define OVERSAMPLE  2   // points expected per round, as a multiple of k
+
+// Row of the shard that holds loaded row <index>, options.positions tells where --order moved it, so every
+// initializer draws the same rows whatever order they are swept in
+static inline size_t loaded(const size_t *positions, long long index) {
+    return (positions != NULL)? positions[index]: index;
+}
+
+// Copy the rows with the given global indices into means, each rank contributes the ones in its shard
+static void gather_rows(const DataFrame &data, unsigned int dimension, const std::vector<long long> &indices, double *means,
+                        const size_t *positions, bool distributed, MPI_Comm comm) {
+    std::fill_n(means, indices.size() * dimension, 0.0);
+
+    for (size_t i = 0; i < indices.size(); i++) {
+        const long long index = indices[i] - (long long) data.offset();
+        if (index >= 0 && index < (long long) data.size()) {
+            if (data.single()) {
+                std::copy_n(data.row<float>(loaded(positions, index)), dimension, means + i * dimension);
+            } else {
+                std::copy_n(data[loaded(positions, index)], dimension, means + i * dimension);
+            }
+        }
+    }
+
+    if (distributed) {
+        MPI_Allreduce(MPI_IN_PLACE, means, indices.size() * dimension, MPI_DOUBLE, MPI_SUM, comm);
+    }
+}
+
+// Pick centroids as random points from the whole dataset
+static void random_init(const DataFrame &data, unsigned int k, unsigned int dimension, double *means, std::mt19937_64 &rng,
+                        const size_t *positions, bool distributed, MPI_Comm comm) {
+    int world_rank = MASTER;
+    if (distributed) {
+        MPI_Comm_rank(comm, &world_rank);
+    }
+
+    std::vector<long long> indices(k);
+    std::uniform_int_distribution<long long> uniform(0, data.total() - 1);
+
+    if (world_rank == MASTER) {
+        for (unsigned int i = 0; i < k; i++) {
+            indices[i] = uniform(rng);
+        }
+    }
+
+    if (distributed) {
+        MPI_Bcast(indices.data(), k, MPI_LONG_LONG_INT, MASTER, comm);
+    }
+
+    gather_rows(data, dimension, indices, means, positions, distributed, comm);
+}
+
+// Index drawn with probability proportional to its score, uniform when every score is zero
+static size_t weighted_pick(const std::vector<double> &scores, double total, std::mt19937_64 &rng) {
+    if (total <= 0) {
+        return std::uniform_int_distribution<size_t>(0, scores.size() - 1)(rng);
+    }
+
+    const double target = std::uniform_real_distribution<double>(0, total)(rng);
+    double running = 0;
+    for (size_t i = 0; i < scores.size(); i++) {
+        running += scores[i];
+        if (running > target) {
+            return i;
+        }
+    }
+
+    return scores.size() - 1;
+}
+
+// k-means++ over n rows, optionally weighted, each new centroid is drawn proportionally to weight * D^2
+template <typename P>
+static void kmeanspp_init(const P *rows, const double *weights, size_t n, unsigned int k, unsigned int dimension,
+                          double *means, std::mt19937_64 &rng, const size_t *positions, bool parallel) {
+    std::vector<double> distances(n, 1);
+    std::vector<double> scores(n);
+
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        double total = 0;
+        #pragma omp parallel for reduction(+:total) if(parallel)
+        for (long long row = 0; row < (long long) n; row++) {
+            scores[row] = (weights != NULL)? weights[row] * distances[row]: distances[row];
+            total += scores[row];
+        }
+
+        const size_t picked = weighted_pick(scores, total, rng);
+        const double *mean = means + (size_t) cluster * dimension;
+        std::copy_n(rows + loaded(positions, picked) * dimension, dimension, means + (size_t) cluster * dimension);
+
+        // D^2 only ever shrinks, so compare against the newest centroid alone
+        #pragma omp parallel for if(parallel)
+        for (long long row = 0; row < (long long) n; row++) {
+            const double distance = squared_euclidean_distance(rows + loaded(positions, row) * dimension, mean, dimension);
+            distances[row] = (cluster == 0)? distance: std::min(distances[row], distance);
+        }
+    }
+}
+
+// k-means|| (Bahmani et al.), every rank oversamples its own shard and the weighted candidates are reclustered
+template <typename P>
+static void kmeans_parallel_init(const DataFrame &data, unsigned int k, unsigned int dimension, double *means,
+                                 std::mt19937_64 &rng, unsigned long long seed, const size_t *positions, bool distributed,
+                                 MPI_Comm comm, bool parallel) {
+    int world_size = 1, world_rank = MASTER;
+    if (distributed) {
+        MPI_Comm_size(comm, &world_size);
+        MPI_Comm_rank(comm, &world_rank);
+    }
+
+    const long long points = data.size();
+    std::seed_seq shard_seed{ seed, (unsigned long long) world_rank };
+    std::mt19937_64 shard_rng(shard_seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    std::vector<double> candidates(dimension);
+    random_init(data, 1, dimension, candidates.data(), rng, positions, distributed, comm);
+
+    std::vector<double> distances(points);
+    #pragma omp parallel for if(parallel)
+    for (long long point = 0; point < points; point++) {
+        distances[point] = squared_euclidean_distance(data.row<P>(loaded(positions, point)), candidates.data(), dimension);
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+        double cost = 0;
+        #pragma omp parallel for reduction(+:cost) if(parallel)
+        for (long long point = 0; point < points; point++) {
+            cost += distances[point];
+        }
+
+        if (distributed) {
+            MPI_Allreduce(MPI_IN_PLACE, &cost, 1, MPI_DOUBLE, MPI_SUM, comm);
+        }
+
+        if (cost <= 0) {
+            break;
+        }
+
+        // Sample every point independently with probability OVERSAMPLE * k * D^2 / cost
+        std::vector<double> sampled;
+        for (long long point = 0; point < points; point++) {
+            if (uniform(shard_rng) < OVERSAMPLE * k * distances[point] / cost) {
+                const P *row = data.row<P>(loaded(positions, point));
+                sampled.insert(sampled.end(), row, row + dimension);
+            }
+        }
+
+        // Every rank gets the candidates sampled by all the others
+        std::vector<double> new_candidates;
+        if (distributed) {
+            int length = sampled.size();
+            std::vector<int> lengths(world_size), displacements(world_size, 0);
+            MPI_Allgather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, comm);
+            for (int rank = 1; rank < world_size; rank++) {
+                displacements[rank] = displacements[rank - 1] + lengths[rank - 1];
+            }
+
+            new_candidates.resize(displacements[world_size - 1] + lengths[world_size - 1]);
+            MPI_Allgatherv(sampled.data(), length, MPI_DOUBLE, new_candidates.data(), lengths.data(), displacements.data(), MPI_DOUBLE, comm);
+        } else {
+            new_candidates.swap(sampled);
+        }
+
+        const size_t first = candidates.size() / dimension;
+        candidates.insert(candidates.end(), new_candidates.begin(), new_candidates.end());
+        const size_t last = candidates.size() / dimension;
+
+        #pragma omp parallel for if(parallel)
+        for (long long point = 0; point < points; point++) {
+            for (size_t candidate = first; candidate < last; candidate++) {
+                const double distance = squared_euclidean_distance(data.row<P>(loaded(positions, point)),
+                                                                   &candidates[candidate * dimension], dimension);
+                distances[point] = std::min(distances[point], distance);
+            }
+        }
+    }
+
+    // Weight every candidate by the number of points closest to it
+    const unsigned int m = candidates.size() / dimension;
+    const bool single = std::is_same<P, float>::value;
+    const Nearest<P> nearest = select_nearest<P>(dimension, single);
+    Centroids packed;
+    packed.pack(candidates.data(), m, dimension, single);
+    std::vector<double> weights(m, 0);
+    double *weight = weights.data();
+
+    #pragma omp parallel for reduction(+:weight[:m]) if(parallel)
+    for (long long point = 0; point < points; point++) {
+        double distance;
+        weight[nearest(data.row<P>(loaded(positions, point)), packed, &distance)] += 1;
+    }
+
+    if (distributed) {
+        MPI_Allreduce(MPI_IN_PLACE, weights.data(), m, MPI_DOUBLE, MPI_SUM, comm);
+    }
+
+    // Recluster the candidates into k centroids on MASTER
+    if (world_rank == MASTER) {
+        kmeanspp_init(candidates.data(), weights.data(), m, k, dimension, means, rng, NULL, parallel);
+    }
+
+    if (distributed) {
+        MPI_Bcast(means, k * dimension, MPI_DOUBLE, MASTER, comm);
+    }
+}
+
+void initialize_means(const DataFrame &data, unsigned int k, unsigned int dimension, double *means,
+                      const KMeansOptions &options, bool distributed, bool parallel) {
+    // MASTER's seed wins, so every rank draws the same shared decisions
+    unsigned long long seed = options.seed;
+    if (distributed) {
+        MPI_Bcast(&seed, 1, MPI_UNSIGNED_LONG_LONG, MASTER, options.comm);
+    }
+
+    std::mt19937_64 rng(seed);
+
+    const size_t *positions = options.positions;
+    if (options.init == "random") {
+        random_init(data, k, dimension, means, rng, positions, distributed, options.comm);
+    } else if ((options.init == "kmeans||" || distributed) && data.single()) {
+        kmeans_parallel_init<float>(data, k, dimension, means, rng, seed, positions, distributed, options.comm, parallel);
+    } else if (options.init == "kmeans||" || distributed) {
+        kmeans_parallel_init<double>(data, k, dimension, means, rng, seed, positions, distributed, options.comm, parallel);
+    } else if (data.single()) {
+        kmeanspp_init(data.single_data(), NULL, data.size(), k, dimension, means, rng, positions, parallel);
+    } else {
+        kmeanspp_init(data.data(), NULL, data.size(), k, dimension, means, rng, positions, parallel);
+    }
+}
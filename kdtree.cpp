@@ -0,0 +1,391 @@
+#include <omp.h>
+#include <mpi.h>
+#include <math.h>
+#include <atomic>
+#include <algorithm>
+#include "kmeans.h"
+#include "trace.h"
+#include "checkpoint.h"
+
+#define LEAF_SIZE       32      // points below which a cell is not split any further
+#define TASK_POINTS     4096    // cells smaller than this are filtered by the task that reached them
+#define OWNER_MIXED     std::numeric_limits<unsigned int>::max()
+
+// A cell of the tree, its points are order[begin, end). The bounding box, the sum of the points and their
+// squared distances to the cell mean are cached per cell in KdTree, so a cell owned by one centroid is never opened.
+struct KdNode {
+    long long begin, end;
+    unsigned int left, right;   // 0 for leaves, the root is never a child
+};
+
+struct KdTree {
+    unsigned int dimension = 0;
+    std::vector<KdNode> nodes;
+    std::vector<long long> order;
+    std::vector<double> boxes;      // lower then upper corner, 2 * dimension per cell
+    std::vector<double> sums;       // dimension per cell
+    std::vector<double> scatters;   // sum of the squared distances of the points of a cell to its mean
+    std::atomic<unsigned int> allocated{0};
+
+    const double *lower(unsigned int node) const { return &boxes[(size_t) node * 2 * dimension]; }
+    const double *upper(unsigned int node) const { return lower(node) + dimension; }
+};
+
+// Split the cell at the median of its widest side, both halves are built by their own task while the
+// cell is large, and the sums are folded bottom up once both halves are done
+static void build_node(const DataFrame &data, KdTree &tree, unsigned int node, long long begin, long long end) {
+    const unsigned int dimension = tree.dimension;
+    double *lower = &tree.boxes[(size_t) node * 2 * dimension];
+    double *upper = lower + dimension;
+    double *sum = &tree.sums[(size_t) node * dimension];
+    KdNode &cell = tree.nodes[node];
+    cell.begin = begin;
+    cell.end = end;
+    cell.left = cell.right = 0;
+
+    std::fill_n(lower, dimension, std::numeric_limits<double>::max());
+    std::fill_n(upper, dimension, std::numeric_limits<double>::lowest());
+    for (long long i = begin; i < end; i++) {
+        const double *row = data[tree.order[i]];
+        for (unsigned int d = 0; d < dimension; d++) {
+            lower[d] = std::min(lower[d], row[d]);
+            upper[d] = std::max(upper[d], row[d]);
+        }
+    }
+
+    if (end - begin <= LEAF_SIZE) {
+        std::fill_n(sum, dimension, 0.0);
+        for (long long i = begin; i < end; i++) {
+            const double *row = data[tree.order[i]];
+            for (unsigned int d = 0; d < dimension; d++) {
+                sum[d] += row[d];
+            }
+        }
+
+        // Centered in a second pass, squared norms far from the origin would cancel each other out
+        double scatter = 0;
+        for (long long i = begin; i < end; i++) {
+            const double *row = data[tree.order[i]];
+            for (unsigned int d = 0; d < dimension; d++) {
+                scatter += square(row[d] - sum[d] / (end - begin));
+            }
+        }
+        tree.scatters[node] = scatter;
+        return;
+    }
+
+    unsigned int widest = 0;
+    for (unsigned int d = 1; d < dimension; d++) {
+        if (upper[d] - lower[d] > upper[widest] - lower[widest]) {
+            widest = d;
+        }
+    }
+
+    const long long middle = begin + (end - begin) / 2;
+    std::nth_element(tree.order.begin() + begin, tree.order.begin() + middle, tree.order.begin() + end,
+                     [&](long long first, long long second) { return data[first][widest] < data[second][widest]; });
+
+    const unsigned int left = tree.allocated.fetch_add(2);
+    const unsigned int right = left + 1;
+    cell.left = left;
+    cell.right = right;
+
+    #pragma omp task if(end - begin > TASK_POINTS) shared(data, tree)
+    build_node(data, tree, left, begin, middle);
+    #pragma omp task if(end - begin > TASK_POINTS) shared(data, tree)
+    build_node(data, tree, right, middle, end);
+    #pragma omp taskwait
+
+    // Chan et al.: the scatters of both halves plus the spread between their means
+    const double left_count = middle - begin, right_count = end - middle;
+    double spread = 0;
+    for (unsigned int d = 0; d < dimension; d++) {
+        const double left_sum = tree.sums[(size_t) left * dimension + d], right_sum = tree.sums[(size_t) right * dimension + d];
+        sum[d] = left_sum + right_sum;
+        spread += square(left_sum / left_count - right_sum / right_count);
+    }
+    tree.scatters[node] = tree.scatters[left] + tree.scatters[right] + left_count * right_count / (end - begin) * spread;
+}
+
+// Built once per run over the rows of the frame, which are never moved
+static void build_tree(const DataFrame &data, unsigned int dimension, KdTree &tree, bool parallel) {
+    const long long points = data.size();
+
+    // Median splits leave more than LEAF_SIZE / 2 points in every leaf, so this bounds the cell count
+    const size_t capacity = 4 * (points / LEAF_SIZE + 1);
+    tree.dimension = dimension;
+    tree.nodes.resize(capacity);
+    tree.boxes.resize(capacity * 2 * dimension);
+    tree.sums.resize(capacity * dimension);
+    tree.scatters.resize(capacity);
+    tree.order.resize(points);
+    for (long long point = 0; point < points; point++) {
+        tree.order[point] = point;
+    }
+    tree.allocated = 1;
+
+    #pragma omp parallel if(parallel)
+    #pragma omp single
+    build_node(data, tree, 0, 0, points);
+
+    tree.nodes.resize(tree.allocated);
+}
+
+// State of one filtering pass, the sums and counts go to the accumulator slice of the thread doing the work
+struct Filter {
+    const DataFrame &data;
+    const KdTree &tree;
+    const double *means;
+    unsigned int k;
+    unsigned int *point_clusters;
+    std::vector<unsigned int> &owners;  // centroid every point of a cell was labelled with, or OWNER_MIXED
+    Accumulators &accumulators;
+    std::vector<long long> &evaluations;  // one cache line per thread
+    bool first;
+};
+
+#define EVALUATION_STRIDE   (CACHE_LINE / sizeof(long long))
+
+// Give a whole cell to <cluster> from its cached sums. Its points are only visited when their labels change,
+// which the owner of the cell from the last pass tells without looking at them.
+static void assign_cell(Filter &filter, unsigned int node, unsigned int cluster) {
+    const unsigned int dimension = filter.tree.dimension;
+    const KdNode &cell = filter.tree.nodes[node];
+    const double *mean = &filter.means[cluster * dimension];
+    const double *cell_sum = &filter.tree.sums[(size_t) node * dimension];
+    const long long count = cell.end - cell.begin;
+
+    double *sums = filter.accumulators.sums(omp_get_thread_num());
+    double *counts = filter.accumulators.counts(omp_get_thread_num());
+
+    // sum of |x - m|^2 = sum of |x - c|^2 + count |c - m|^2 around the cell mean c
+    double offset = 0;
+    for (unsigned int d = 0; d < dimension; d++) {
+        sums[cluster * dimension + d] += cell_sum[d];
+        offset += square(cell_sum[d] / count - mean[d]);
+    }
+    counts[cluster] += count;
+    counts[filter.k + TOTAL_INERTIA] += filter.tree.scatters[node] + count * offset;
+
+    if (filter.first || filter.owners[node] != cluster) {
+        double changed = 0;
+        for (long long i = cell.begin; i < cell.end; i++) {
+            const long long point = filter.tree.order[i];
+            if (filter.first || filter.point_clusters[point] != cluster) {
+                changed += 1;
+            }
+            filter.point_clusters[point] = cluster;
+        }
+        counts[filter.k + TOTAL_CHANGED] += changed;
+    }
+    filter.owners[node] = cluster;
+}
+
+// Kanungo et al.: keep the candidates that may still be the closest centroid of some point of the cell, the
+// one closest to its center survives and every candidate farther from the whole box than it is dropped
+static void filter_node(Filter &filter, unsigned int node, std::vector<unsigned int> candidates) {
+    const unsigned int dimension = filter.tree.dimension;
+    const KdNode &cell = filter.tree.nodes[node];
+    const double *lower = filter.tree.lower(node);
+    const double *upper = filter.tree.upper(node);
+    const double *means = filter.means;
+    long long evaluations = 0;
+
+    unsigned int closest = candidates[0];
+    double closest_distance = std::numeric_limits<double>::max();
+    for (unsigned int candidate : candidates) {
+        double distance = 0;
+        for (unsigned int d = 0; d < dimension; d++) {
+            distance += square(0.5 * (lower[d] + upper[d]) - means[candidate * dimension + d]);
+        }
+        if (distance < closest_distance) {
+            closest_distance = distance;
+            closest = candidate;
+        }
+    }
+    evaluations += candidates.size();
+
+    // A candidate is farther than the closest one from the whole box when it is from the corner furthest towards it
+    const double *best = &means[closest * dimension];
+    size_t kept = 0;
+    for (unsigned int candidate : candidates) {
+        const double *mean = &means[candidate * dimension];
+        double to_candidate = 0, to_closest = 0;
+        for (unsigned int d = 0; d < dimension; d++) {
+            const double corner = (mean[d] > best[d])? upper[d]: lower[d];
+            to_candidate += square(corner - mean[d]);
+            to_closest += square(corner - best[d]);
+        }
+        if (candidate == closest || to_candidate < to_closest) {
+            candidates[kept++] = candidate;
+        }
+    }
+    candidates.resize(kept);
+
+    filter.evaluations[omp_get_thread_num() * EVALUATION_STRIDE] += evaluations;
+    if (candidates.size() == 1) {
+        assign_cell(filter, node, closest);
+        return;
+    }
+
+    // Cells owned by one centroid last pass hand their owner down, their points all carry that label
+    if (cell.left != 0 && filter.owners[node] != OWNER_MIXED) {
+        filter.owners[cell.left] = filter.owners[cell.right] = filter.owners[node];
+    }
+    filter.owners[node] = OWNER_MIXED;
+
+    if (cell.left == 0) {
+        // Leaves compare their points with the remaining candidates one by one
+        double *sums = filter.accumulators.sums(omp_get_thread_num());
+        double *counts = filter.accumulators.counts(omp_get_thread_num());
+        for (long long i = cell.begin; i < cell.end; i++) {
+            const long long point = filter.tree.order[i];
+            const double *row = filter.data[point];
+            unsigned int cluster = candidates[0];
+            double bound = std::numeric_limits<double>::max();
+            for (unsigned int candidate : candidates) {
+                const double distance = squared_euclidean_distance(row, &means[candidate * dimension], dimension);
+                if (distance < bound) {
+                    bound = distance;
+                    cluster = candidate;
+                }
+            }
+
+            if (filter.first || cluster != filter.point_clusters[point]) {
+                counts[filter.k + TOTAL_CHANGED] += 1;
+            }
+            filter.point_clusters[point] = cluster;
+            counts[filter.k + TOTAL_INERTIA] += bound;
+
+            for (unsigned int d = 0; d < dimension; d++) {
+                sums[cluster * dimension + d] += row[d];
+            }
+            counts[cluster] += 1;
+        }
+        filter.evaluations[omp_get_thread_num() * EVALUATION_STRIDE] += (cell.end - cell.begin) * candidates.size();
+        return;
+    }
+
+    const unsigned int left = cell.left, right = cell.right;
+    const bool spawn = (cell.end - cell.begin > TASK_POINTS);
+    #pragma omp task if(spawn) shared(filter) firstprivate(candidates)
+    filter_node(filter, left, candidates);
+    #pragma omp task if(spawn) shared(filter) firstprivate(candidates)
+    filter_node(filter, right, candidates);
+    #pragma omp taskwait
+}
+
+// Filtering k-means (Kanungo et al.) over a kd-tree of the rows, built once and traversed every iteration
+// by OpenMP tasks. Every centroid the tree rules out for a cell is skipped for all of its points, which pays
+// off for the 2-d and 3-d inputs Point was designed for and fades as the dimension grows. The distributed
+// variants build one tree per shard and combine the totals like kmeansMPI/kmeansHybrid.
+static DataFrame kmeansKdTree(const DataFrame &data, unsigned int k, unsigned int *point_clusters,
+                              const KMeansOptions &options, KMeansSummary &summary, bool distributed, bool parallel) {
+    unsigned int dimension = data.dimension();
+    if (distributed) {
+        MPI_Allreduce(MPI_IN_PLACE, &dimension, 1, MPI_UNSIGNED, MPI_MAX, options.comm);
+    }
+
+    summary = KMeansSummary();
+    const long long points = data.size();
+    const int values = k * dimension;
+
+    DataFrame means(k, dimension);
+    Checkpoint checkpoint(options, k, dimension, distributed);
+    int first_iteration = checkpoint.resume(means.data(), summary);
+    if (first_iteration < 0) {
+        TraceSpan span(TRACE_SEED);
+        initialize_means(data, k, dimension, means.data(), options, distributed, parallel);
+        first_iteration = 0;
+    }
+
+    KdTree tree;
+    if (points > 0) {
+        build_tree(data, dimension, tree, parallel);
+    }
+    std::vector<unsigned int> owners(tree.nodes.size(), OWNER_MIXED);
+
+    // The evaluations of the shard travel after the totals, so one MPI_Allreduce still combines everything
+    const int threads = parallel? omp_get_max_threads(): 1;
+    Accumulators accumulators(threads, k, dimension);
+    const int size = accumulators.size();
+    std::vector<double> partials(size + 1), totals(size + 1);
+    std::vector<long long> evaluations(threads * EVALUATION_STRIDE);
+    const double *counts = &totals[values];
+
+    std::vector<unsigned int> candidates(k);
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        candidates[cluster] = cluster;
+    }
+
+    for (int iteration = first_iteration; iteration < options.max_iterations; iteration++) {
+        trace_iteration(iteration);
+        Filter filter{ data, tree, means.data(), k, point_clusters, owners, accumulators, evaluations, iteration == first_iteration };
+        std::fill(evaluations.begin(), evaluations.end(), 0);
+
+        #pragma omp parallel if(parallel)
+        {
+            const int thread_id = omp_get_thread_num();
+            accumulators.clear(thread_id);
+
+            {
+                TraceSpan span(TRACE_ASSIGN);
+                #pragma omp single
+                if (points > 0) {
+                    filter_node(filter, 0, candidates);
+                }
+            }
+
+            TraceSpan span(TRACE_REDUCE);
+            accumulators.reduce(thread_id, omp_get_num_threads());
+        }
+
+        std::copy_n(accumulators.sums(0), size, partials.begin());
+        partials[size] = 0;
+        for (int thread = 0; thread < threads; thread++) {
+            partials[size] += evaluations[thread * EVALUATION_STRIDE];
+        }
+
+        if (distributed) {
+            TraceSpan span(TRACE_COMMUNICATE);
+            MPI_Allreduce(partials.data(), totals.data(), size + 1, MPI_DOUBLE, MPI_SUM, options.comm);
+        } else {
+            totals.swap(partials);
+            counts = &totals[values];
+        }
+
+        double shift;
+        {
+            TraceSpan span(TRACE_UPDATE);
+            shift = update_means(means.data(), totals.data(), counts, k, dimension, parallel);
+        }
+
+        summary.distance_evaluations += totals[size];
+        trace_count(TRACE_CHANGED, counts[k + TOTAL_CHANGED]);
+        trace_count(TRACE_INERTIA, counts[k + TOTAL_INERTIA]);
+        trace_count(TRACE_SHIFT, shift);
+
+        if (should_stop(options, summary, counts[k + TOTAL_CHANGED], counts[k + TOTAL_INERTIA], shift)) {
+            break;
+        }
+        checkpoint.save(iteration + 1, means.data(), summary);
+    }
+
+    return means;
+}
+
+DataFrame kmeansKdTreeSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansKdTree(data, k, point_clusters, options, summary, false, false);
+}
+
+DataFrame kmeansKdTreeOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansKdTree(data, k, point_clusters, options, summary, false, true);
+}
+
+DataFrame kmeansKdTreeMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansKdTree(data, k, point_clusters, options, summary, true, false);
+}
+
+DataFrame kmeansKdTreeHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansKdTree(data, k, point_clusters, options, summary, true, true);
+}
@@ -0,0 +1,348 @@
+#include <math.h>
+#include <immintrin.h>
+#include <algorithm>
+#include "kmeans.h"
+
+#define ISA_SCALAR  0
+#define ISA_AVX2    1
+#define ISA_AVX512  2
+
+static const char *isa_names[] = { "scalar", "avx2", "avx512" };
+
+static int detect_isa() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return ISA_AVX2;
+    }
+    return ISA_SCALAR;
+}
+
+static const int detected_isa = detect_isa();
+static int isa = detected_isa;
+
+double square(double value) {
+    return value * value;
+}
+
+double squared_euclidean_distance(const double *first, const double *second, unsigned int dimension) {
+    double distance = 0;
+    for (unsigned int d = 0; d < dimension; d++) {
+        distance += square(first[d] - second[d]);
+    }
+    return distance;
+}
+
+double squared_euclidean_distance(const float *first, const double *second, unsigned int dimension) {
+    double distance = 0;
+    for (unsigned int d = 0; d < dimension; d++) {
+        distance += square(first[d] - second[d]);
+    }
+    return distance;
+}
+
+void Centroids::pack(const double *means, unsigned int k, unsigned int dimension, bool single) {
+    const unsigned int lanes = single? SINGLE_LANES: DOUBLE_LANES;
+
+    this->k = k;
+    this->dimension = dimension;
+    this->single = single;
+    this->blocks = (k + lanes - 1) / lanes;
+
+    // Padding lanes sit at infinity, so they never win the argmin
+    if (single) {
+        single_values.assign((size_t) blocks * dimension * lanes, INFINITY);
+    } else {
+        values.assign((size_t) blocks * dimension * lanes, INFINITY);
+    }
+
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        const size_t base = (size_t) (cluster / lanes) * dimension * lanes + cluster % lanes;
+        for (unsigned int d = 0; d < dimension; d++) {
+            if (single) {
+                single_values[base + d * lanes] = means[(size_t) cluster * dimension + d];
+            } else {
+                values[base + d * lanes] = means[(size_t) cluster * dimension + d];
+            }
+        }
+    }
+}
+
+// Fold the per-lane winners, the lowest cluster index wins a tie like in the scalar loop
+template <typename T, typename I>
+static unsigned int pick_lane(const T *best, const I *best_cluster, unsigned int lanes, double *distance) {
+    unsigned int lane = 0;
+    for (unsigned int other = 1; other < lanes; other++) {
+        if (best[other] < best[lane] || (best[other] == best[lane] && best_cluster[other] < best_cluster[lane])) {
+            lane = other;
+        }
+    }
+
+    *distance = best[lane];
+    return best_cluster[lane];
+}
+
+template <typename T>
+static const T *packed_values(const Centroids &centroids);
+
+template <>
+const double *packed_values<double>(const Centroids &centroids) {
+    return centroids.values.data();
+}
+
+template <>
+const float *packed_values<float>(const Centroids &centroids) {
+    return centroids.single_values.data();
+}
+
+// D is the dimension fixed at compile time so the inner loop unrolls, 0 falls back to the runtime one.
+// The vector kernels add the squares in the same order without FMA, so they match this one bit for bit.
+// P is how the point is stored, T the arithmetic, float points only come with float arithmetic.
+template <unsigned int D, typename T, typename P>
+static unsigned int nearest_scalar(const P *point, const Centroids &centroids, double *distance) {
+    const unsigned int dims = (D > 0)? D: centroids.dimension;
+    const unsigned int lanes = 64 / sizeof(T);
+    const T *values = packed_values<T>(centroids);
+
+    T best_distance = INFINITY;
+    unsigned int best_cluster = 0;
+    for (unsigned int block = 0; block < centroids.blocks; block++) {
+        const T *base = values + (size_t) block * dims * lanes;
+        for (unsigned int lane = 0; lane < lanes; lane++) {
+            T current = 0;
+            for (unsigned int d = 0; d < dims; d++) {
+                const T diff = (T) point[d] - base[d * lanes + lane];
+                current += diff * diff;
+            }
+
+            if (current < best_distance) {
+                best_cluster = block * lanes + lane;
+                best_distance = current;
+            }
+        }
+    }
+
+    *distance = best_distance;
+    return best_cluster;
+}
+
+template <unsigned int D>
+__attribute__((target("avx2")))
+static unsigned int nearest_avx2(const double *point, const Centroids &centroids, double *distance) {
+    const unsigned int dims = (D > 0)? D: centroids.dimension;
+    const double *values = centroids.values.data();
+
+    // A block of 8 centroids spans two registers
+    __m256d best_low = _mm256_set1_pd(INFINITY), best_high = _mm256_set1_pd(INFINITY);
+    __m256d best_low_cluster = _mm256_setzero_pd(), best_high_cluster = _mm256_setzero_pd();
+    __m256d low_cluster = _mm256_setr_pd(0, 1, 2, 3), high_cluster = _mm256_setr_pd(4, 5, 6, 7);
+    const __m256d step = _mm256_set1_pd(DOUBLE_LANES);
+
+    for (unsigned int block = 0; block < centroids.blocks; block++) {
+        const double *base = values + (size_t) block * dims * DOUBLE_LANES;
+        __m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd();
+        for (unsigned int d = 0; d < dims; d++) {
+            const __m256d coordinate = _mm256_set1_pd(point[d]);
+            const __m256d low_diff = _mm256_sub_pd(coordinate, _mm256_loadu_pd(base + d * DOUBLE_LANES));
+            const __m256d high_diff = _mm256_sub_pd(coordinate, _mm256_loadu_pd(base + d * DOUBLE_LANES + 4));
+            low = _mm256_add_pd(low, _mm256_mul_pd(low_diff, low_diff));
+            high = _mm256_add_pd(high, _mm256_mul_pd(high_diff, high_diff));
+        }
+
+        const __m256d low_closer = _mm256_cmp_pd(low, best_low, _CMP_LT_OQ);
+        const __m256d high_closer = _mm256_cmp_pd(high, best_high, _CMP_LT_OQ);
+        best_low = _mm256_blendv_pd(best_low, low, low_closer);
+        best_high = _mm256_blendv_pd(best_high, high, high_closer);
+        best_low_cluster = _mm256_blendv_pd(best_low_cluster, low_cluster, low_closer);
+        best_high_cluster = _mm256_blendv_pd(best_high_cluster, high_cluster, high_closer);
+        low_cluster = _mm256_add_pd(low_cluster, step);
+        high_cluster = _mm256_add_pd(high_cluster, step);
+    }
+
+    double best[DOUBLE_LANES], best_cluster[DOUBLE_LANES];
+    _mm256_storeu_pd(best, best_low);
+    _mm256_storeu_pd(best + 4, best_high);
+    _mm256_storeu_pd(best_cluster, best_low_cluster);
+    _mm256_storeu_pd(best_cluster + 4, best_high_cluster);
+
+    return pick_lane(best, best_cluster, DOUBLE_LANES, distance);
+}
+
+template <unsigned int D, typename P>
+__attribute__((target("avx2")))
+static unsigned int nearest_avx2_single(const P *point, const Centroids &centroids, double *distance) {
+    const unsigned int dims = (D > 0)? D: centroids.dimension;
+    const float *values = centroids.single_values.data();
+
+    // A block of 16 centroids spans two registers, cluster indices stay exact as floats up to 2^24
+    __m256 best_low = _mm256_set1_ps(INFINITY), best_high = _mm256_set1_ps(INFINITY);
+    __m256 best_low_cluster = _mm256_setzero_ps(), best_high_cluster = _mm256_setzero_ps();
+    __m256 low_cluster = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), high_cluster = _mm256_setr_ps(8, 9, 10, 11, 12, 13, 14, 15);
+    const __m256 step = _mm256_set1_ps(SINGLE_LANES);
+
+    for (unsigned int block = 0; block < centroids.blocks; block++) {
+        const float *base = values + (size_t) block * dims * SINGLE_LANES;
+        __m256 low = _mm256_setzero_ps(), high = _mm256_setzero_ps();
+        for (unsigned int d = 0; d < dims; d++) {
+            const __m256 coordinate = _mm256_set1_ps((float) point[d]);
+            const __m256 low_diff = _mm256_sub_ps(coordinate, _mm256_loadu_ps(base + d * SINGLE_LANES));
+            const __m256 high_diff = _mm256_sub_ps(coordinate, _mm256_loadu_ps(base + d * SINGLE_LANES + 8));
+            low = _mm256_add_ps(low, _mm256_mul_ps(low_diff, low_diff));
+            high = _mm256_add_ps(high, _mm256_mul_ps(high_diff, high_diff));
+        }
+
+        const __m256 low_closer = _mm256_cmp_ps(low, best_low, _CMP_LT_OQ);
+        const __m256 high_closer = _mm256_cmp_ps(high, best_high, _CMP_LT_OQ);
+        best_low = _mm256_blendv_ps(best_low, low, low_closer);
+        best_high = _mm256_blendv_ps(best_high, high, high_closer);
+        best_low_cluster = _mm256_blendv_ps(best_low_cluster, low_cluster, low_closer);
+        best_high_cluster = _mm256_blendv_ps(best_high_cluster, high_cluster, high_closer);
+        low_cluster = _mm256_add_ps(low_cluster, step);
+        high_cluster = _mm256_add_ps(high_cluster, step);
+    }
+
+    float best[SINGLE_LANES], best_cluster[SINGLE_LANES];
+    _mm256_storeu_ps(best, best_low);
+    _mm256_storeu_ps(best + 8, best_high);
+    _mm256_storeu_ps(best_cluster, best_low_cluster);
+    _mm256_storeu_ps(best_cluster + 8, best_high_cluster);
+
+    return pick_lane(best, best_cluster, SINGLE_LANES, distance);
+}
+
+template <unsigned int D>
+__attribute__((target("avx512f")))
+static unsigned int nearest_avx512(const double *point, const Centroids &centroids, double *distance) {
+    const unsigned int dims = (D > 0)? D: centroids.dimension;
+    const double *values = centroids.values.data();
+
+    __m512d best = _mm512_set1_pd(INFINITY);
+    __m512i best_cluster = _mm512_setzero_si512();
+    __m512i cluster = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512i step = _mm512_set1_epi64(DOUBLE_LANES);
+
+    for (unsigned int block = 0; block < centroids.blocks; block++) {
+        const double *base = values + (size_t) block * dims * DOUBLE_LANES;
+        __m512d current = _mm512_setzero_pd();
+        for (unsigned int d = 0; d < dims; d++) {
+            const __m512d diff = _mm512_sub_pd(_mm512_set1_pd(point[d]), _mm512_loadu_pd(base + d * DOUBLE_LANES));
+            current = _mm512_add_pd(current, _mm512_mul_pd(diff, diff));
+        }
+
+        const __mmask8 closer = _mm512_cmp_pd_mask(current, best, _CMP_LT_OQ);
+        best = _mm512_mask_mov_pd(best, closer, current);
+        best_cluster = _mm512_mask_mov_epi64(best_cluster, closer, cluster);
+        cluster = _mm512_add_epi64(cluster, step);
+    }
+
+    double lane_best[DOUBLE_LANES];
+    long long lane_cluster[DOUBLE_LANES];
+    _mm512_storeu_pd(lane_best, best);
+    _mm512_storeu_si512(lane_cluster, best_cluster);
+
+    return pick_lane(lane_best, lane_cluster, DOUBLE_LANES, distance);
+}
+
+template <unsigned int D, typename P>
+__attribute__((target("avx512f")))
+static unsigned int nearest_avx512_single(const P *point, const Centroids &centroids, double *distance) {
+    const unsigned int dims = (D > 0)? D: centroids.dimension;
+    const float *values = centroids.single_values.data();
+
+    __m512 best = _mm512_set1_ps(INFINITY);
+    __m512i best_cluster = _mm512_setzero_si512();
+    __m512i cluster = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512i step = _mm512_set1_epi32(SINGLE_LANES);
+
+    for (unsigned int block = 0; block < centroids.blocks; block++) {
+        const float *base = values + (size_t) block * dims * SINGLE_LANES;
+        __m512 current = _mm512_setzero_ps();
+        for (unsigned int d = 0; d < dims; d++) {
+            const __m512 diff = _mm512_sub_ps(_mm512_set1_ps((float) point[d]), _mm512_loadu_ps(base + d * SINGLE_LANES));
+            current = _mm512_add_ps(current, _mm512_mul_ps(diff, diff));
+        }
+
+        const __mmask16 closer = _mm512_cmp_ps_mask(current, best, _CMP_LT_OQ);
+        best = _mm512_mask_mov_ps(best, closer, current);
+        best_cluster = _mm512_mask_mov_epi32(best_cluster, closer, cluster);
+        cluster = _mm512_add_epi32(cluster, step);
+    }
+
+    float lane_best[SINGLE_LANES];
+    int lane_cluster[SINGLE_LANES];
+    _mm512_storeu_ps(lane_best, best);
+    _mm512_storeu_si512(lane_cluster, best_cluster);
+
+    return pick_lane(lane_best, lane_cluster, SINGLE_LANES, distance);
+}
+
+template <unsigned int D>
+static NearestCentroid select_for_dimension(bool single) {
+    switch (isa) {
+        case ISA_AVX512: return single? &nearest_avx512_single<D, double>: &nearest_avx512<D>;
+        case ISA_AVX2:   return single? &nearest_avx2_single<D, double>: &nearest_avx2<D>;
+        default:         return single? &nearest_scalar<D, float, double>: &nearest_scalar<D, double, double>;
+    }
+}
+
+template <unsigned int D>
+static Nearest<float> select_single_for_dimension() {
+    switch (isa) {
+        case ISA_AVX512: return &nearest_avx512_single<D, float>;
+        case ISA_AVX2:   return &nearest_avx2_single<D, float>;
+        default:         return &nearest_scalar<D, float, float>;
+    }
+}
+
+NearestCentroid select_nearest_centroid(unsigned int dimension, bool single) {
+    switch (dimension) {
+        case 2:  return select_for_dimension<2>(single);
+        case 3:  return select_for_dimension<3>(single);
+        case 4:  return select_for_dimension<4>(single);
+        case 8:  return select_for_dimension<8>(single);
+        case 16: return select_for_dimension<16>(single);
+        default: return select_for_dimension<0>(single);
+    }
+}
+
+template <>
+Nearest<double> select_nearest<double>(unsigned int dimension, bool single) {
+    return select_nearest_centroid(dimension, single);
+}
+
+template <>
+Nearest<float> select_nearest<float>(unsigned int dimension, bool) {
+    switch (dimension) {
+        case 2:  return select_single_for_dimension<2>();
+        case 3:  return select_single_for_dimension<3>();
+        case 4:  return select_single_for_dimension<4>();
+        case 8:  return select_single_for_dimension<8>();
+        case 16: return select_single_for_dimension<16>();
+        default: return select_single_for_dimension<0>();
+    }
+}
+
+int select_kernel(const std::string &name) {
+    if (name == "auto") {
+        isa = detected_isa;
+        return 0;
+    }
+
+    for (int level = ISA_SCALAR; level <= ISA_AVX512; level++) {
+        if (name == isa_names[level]) {
+            if (level > detected_isa) {
+                return -1;
+            }
+            isa = level;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const char *kernel_name() {
+    return isa_names[isa];
+}
@@ -1,17 +1,84 @@
 #include <omp.h>
 #include <mpi.h>
-#include <random>
+#include <algorithm>
 #include <errno.h>
-#include <iomanip>
 #include <fstream>
+#include <math.h>
 #include <filesystem>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include "kmeans.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include "numa.h"
 
 #define MASTER      0
-#define ITERATIONS  100
 #define MODE        0775
-#define DataFrame   std::vector<Point>
+#define IO_CHUNK    (1 << 26)
+
+// Parse whitespace separated rows, the first row fixes the dimension for the rest
+int parse_points(char *cursor, const char *stop, std::vector<double> &values, unsigned int &dimension) {
+    while (cursor < stop) {
+        char *newline = (char*) memchr(cursor, '\n', stop - cursor);
+        char *line_end = (newline != NULL)? newline: (char*) stop;
+        *line_end = '\0';
+
+        unsigned int columns = 0;
+        while (true) {
+            char *next;
+            const double value = strtod(cursor, &next);
+            if (next == cursor) {
+                break;
+            }
+
+            values.push_back(value);
+            columns += 1;
+            cursor = next;
+        }
+
+        if (columns > 0) {
+            if (dimension == 0) {
+                dimension = columns;
+            } else if (columns != dimension) {
+                fprintf(stderr, "parse error: found a row with %u values instead of %u\n", columns, dimension);
+                return -1;
+            }
+        }
+
+        cursor = line_end + 1;
+    }
+
+    return 0;
+}
+
+void DataFrame::narrow() {
+    if (is_single) {
+        return;
+    }
+
+    const double *source = data();
+    single_values.assign(source, source + count * dims);
+    values = std::vector<double>();
+    mapping.reset();
+    mapped = NULL;
+    is_single = true;
+}
+
+void DataFrame::widen() {
+    if (!is_single) {
+        return;
+    }
+
+    const float *source = single_data();
+    values.assign(source, source + count * dims);
+    single_values = std::vector<float>();
+    mapping.reset();
+    single_mapped = NULL;
+    is_single = false;
+}
 
 int readfile(std::string filename, DataFrame &points) {
     std::filesystem::path dir("inputs");
@@ -19,28 +86,56 @@ int readfile(std::string filename, DataFrame &points) {
     std::filesystem::path pathname = dir / file;
 
     std::ifstream fp;
-    fp.open(pathname, std::ofstream::in);
+    fp.open(pathname, std::ofstream::in | std::ofstream::binary);
 
     if (fp.is_open()) {
-        double x, y;
+        std::vector<char> buffer(std::filesystem::file_size(pathname) + 1);
+        fp.read(buffer.data(), buffer.size() - 1);
+        fp.close();
 
-        while (!fp.eof()) {
-            fp >> x >> y;
-            points.push_back(Point(x, y));
+        std::vector<double> values;
+        unsigned int dimension = 0;
+        if (parse_points(buffer.data(), buffer.data() + buffer.size() - 1, values, dimension) == -1) {
+            return -1;
         }
 
-        fp.close();
+        points = DataFrame(std::move(values), dimension);
     } else {
         perror("readfile error");
         return -1;
     }
 
-    points.pop_back();
-
     return 0;
 }
 
-int writefile(std::string filename, DataFrame &points, unsigned int *point_clusters) {
+// Format rows as "%12.10g" per value and "%4u" for the label, the layout std::setw(12) and std::setprecision(10)
+// gave, into one buffer so the file is written in a few large calls instead of a flush per line
+static void format_rows(const DataFrame &points, const unsigned int *point_clusters, std::vector<char> &text) {
+    const unsigned int dimension = points.dimension();
+    const size_t line_length = (size_t) dimension * 32 + 16;
+    text.clear();
+    text.reserve(points.size() * line_length / 2);
+
+    char line[4096];
+    std::vector<char> long_line;
+    for (size_t i = 0; i < points.size(); i++) {
+        // Very wide rows are formatted in a buffer of their own
+        char *cursor = line;
+        if (line_length > sizeof(line)) {
+            long_line.resize(line_length);
+            cursor = long_line.data();
+        }
+
+        char *begin = cursor;
+        for (unsigned int d = 0; d < dimension; d++) {
+            cursor += snprintf(cursor, 32, "%12.10g", points.at(i, d));
+        }
+        cursor += snprintf(cursor, 16, "%4u\n", point_clusters[i]);
+        text.insert(text.end(), begin, cursor);
+    }
+}
+
+int writefile(std::string filename, DataFrame &points, unsigned int *point_clusters, bool append) {
     std::filesystem::path dir("outputs");
     std::filesystem::path file(filename);
     std::filesystem::path pathname = dir / file;
@@ -50,13 +145,12 @@ int writefile(std::string filename, DataFrame &points, unsigned int *point_clust
     }
 
     std::ofstream fp;
-    fp.open(pathname, std::ofstream::out);
+    fp.open(pathname, append? std::ofstream::app: std::ofstream::out);
 
     if (fp.is_open()) {
-        for (long unsigned int i = 0; i < points.size(); i++) {
-            fp << std::setfill(' ') << std::setw(12) << std::setprecision(10) << points[i].x << std::setw(12) << std::setprecision(10) << points[i].y << std::setw(4) << point_clusters[i] << std::endl;
-        }
-
+        std::vector<char> text;
+        format_rows(points, point_clusters, text);
+        fp.write(text.data(), text.size());
         fp.close();
     } else {
         perror("writefile error");
@@ -66,497 +160,801 @@ int writefile(std::string filename, DataFrame &points, unsigned int *point_clust
     return 0;
 }
 
-double calculate_time(const struct timespec &starttime, const struct timespec &endtime) {
-        double elapsed;
-        elapsed = endtime.tv_sec - starttime.tv_sec;
-        elapsed += (endtime.tv_nsec - starttime.tv_nsec) / 1000000000.0;
-        return elapsed;
-}
-
-void point_sum(Point *in_point, Point *in_out_point, int *length, MPI_Datatype *dtype) {
-    for (int i = 0; i < *length; i++) { 
-        in_out_point[i].x += in_point[i].x;
-        in_out_point[i].y += in_point[i].y;
-    }
-}
-
-long double square(double value) {
-    return value * value;
+// Whether the file holds all the rows its header promises. The row count comes from the file, so it is
+// compared by division: a corrupt count times the row size could wrap around and pass a multiplication.
+bool holds_rows(const BinaryHeader &header, size_t file_size) {
+    const size_t value_size = (header.dtype == DTYPE_FLOAT32)? sizeof(float): sizeof(double);
+    const size_t row_size = (size_t) header.dimension * value_size;
+    return file_size >= sizeof(BinaryHeader) && row_size > 0 && header.count <= (file_size - sizeof(BinaryHeader)) / row_size;
 }
 
-long double squared_euclidean_distance(const Point &first, const Point &second) {
-    return square(first.x - second.x) + square(first.y - second.y);
-}
-
-DataFrame kmeansSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters) {
-    static std::random_device seed;
-    static std::mt19937 random_number_generator(seed());
-    std::uniform_int_distribution<long long> indices(0, data.size() - 1);
+int readbinary(std::string filename, DataFrame &points) {
+    std::filesystem::path dir("inputs");
+    std::filesystem::path file(filename);
+    std::filesystem::path pathname = dir / file;
 
-    // Pick centroids as random points from the dataset
-    DataFrame means(k);
-    for (unsigned int i = 0; i < means.size(); i++) {
-        means[i] = data[indices(random_number_generator)];
+    int fd = open(pathname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        perror("readbinary error");
+        return -1;
     }
 
-    for (int iteration = 0; iteration < ITERATIONS; iteration++) {
-        // Find the point belongs to which cluster
-        for (long long point = 0; point < (long long) data.size(); point++) {
-            long double best_distance = std::numeric_limits<double>::max();
-            unsigned int best_cluster = 0;
-            for (unsigned int cluster = 0; cluster < k; cluster++) {
-                const long double distance = squared_euclidean_distance(data[point], means[cluster]);
-                if (distance < best_distance) {
-                    best_cluster = cluster;
-                    best_distance = distance;
-                }
-            }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("readbinary error");
+        close(fd);
+        return -1;
+    }
 
-            point_clusters[point] = best_cluster;
-        }
+    BinaryHeader header;
+    if ((size_t) st.st_size < sizeof(BinaryHeader) || pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        fprintf(stderr, "readbinary error: %s is too short for a binary header\n", pathname.c_str());
+        close(fd);
+        return -1;
+    }
 
-        // Sum up and count points for each cluster
-        DataFrame new_means(k);
-        std::vector<long long> counts(k, 0);
-        for (long long point = 0; point < (long long) data.size(); point++) {
-            const unsigned int cluster = point_clusters[point];
-            new_means[cluster].x += data[point].x;
-            new_means[cluster].y += data[point].y;
-            counts[cluster] += 1;
-        }
+    if (memcmp(header.magic, BINARY_MAGIC, sizeof(header.magic)) != 0 || header.version != BINARY_VERSION) {
+        fprintf(stderr, "readbinary error: %s is not a version %d point file\n", pathname.c_str(), BINARY_VERSION);
+        close(fd);
+        return -1;
+    }
 
-        // Divide sums by counts to get new centroids
-        for (unsigned int cluster = 0; cluster < k; cluster++) {
-            const long long count = std::max<long long>(1, counts[cluster]);
-            means[cluster].x = new_means[cluster].x / count;
-            means[cluster].y = new_means[cluster].y / count;
-        }
+    if ((header.dtype != DTYPE_FLOAT64 && header.dtype != DTYPE_FLOAT32) || header.dimension == 0) {
+        fprintf(stderr, "readbinary error: only float64 or float32 points with a dimension are supported\n");
+        close(fd);
+        return -1;
     }
 
-    return means;
-}
+    if (!holds_rows(header, st.st_size)) {
+        fprintf(stderr, "readbinary error: %s is truncated\n", pathname.c_str());
+        close(fd);
+        return -1;
+    }
 
-DataFrame kmeansOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters) {
-    static std::random_device seed;
-    static std::mt19937 random_number_generator(seed());
-    std::uniform_int_distribution<long long> indices(0, data.size() - 1);
+    // Private writable mapping, so the points are paged in lazily and never copied
+    void *region = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    // Pick centroids as random points from the dataset
-    DataFrame means(k);
-    for (unsigned int i = 0; i < means.size(); i++) {
-        means[i] = data[indices(random_number_generator)];
+    if (region == MAP_FAILED) {
+        perror("readbinary error");
+        return -1;
     }
 
-    for (int iteration = 0; iteration < ITERATIONS; iteration++) {
-        DataFrame new_means(k);
-        std::vector<long long> counts(k, 0);
+    size_t length = st.st_size;
+    std::shared_ptr<void> mapping(region, [length](void *address) { munmap(address, length); });
+    madvise(region, length, MADV_SEQUENTIAL);
 
-        std::vector<DataFrame> local_new_means;
-        std::vector<std::vector<long long>> local_counts;
+    char *begin = (char*) region + sizeof(BinaryHeader);
+    if (header.dtype == DTYPE_FLOAT32) {
+        points.map(mapping, (float*) begin, header.count, header.dimension);
+    } else {
+        points.map(mapping, (double*) begin, header.count, header.dimension);
+    }
 
-        #pragma omp parallel
-        {
-            const int thread_id = omp_get_thread_num();
-            const int thread_nums = omp_get_num_threads();
-            
-            #pragma omp single
-            {
-                for (int i = 0; i < thread_nums; i++) {
-                    DataFrame local_new_mean(k);
-                    std::vector<long long> local_count(k, 0);
-                    local_new_means.push_back(local_new_mean);
-                    local_counts.push_back(local_count);
-                }
-            }
+    return 0;
+}
 
-            // Find the point belongs to which cluster
-            #pragma omp for
-            for (long long point = 0; point < (long long) data.size(); point++) {
-                long double best_distance = std::numeric_limits<long double>::max();
-                unsigned int best_cluster = 0;
-                for (unsigned int cluster = 0; cluster < k; cluster++) {
-                    const long double distance = squared_euclidean_distance(data[point], means[cluster]);
-                    if (distance < best_distance) {
-                        best_cluster = cluster;
-                        best_distance = distance;
-                    }
-                }
+int writebinary(std::string filename, const DataFrame &points) {
+    std::filesystem::path dir("inputs");
+    std::filesystem::path file(filename);
+    std::filesystem::path pathname = dir / file;
 
-                point_clusters[point] = best_cluster;
-            }
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+    header.version = BINARY_VERSION;
+    header.dtype = points.single()? DTYPE_FLOAT32: DTYPE_FLOAT64;
+    header.count = points.size();
+    header.dimension = points.dimension();
 
-            // Sum up and count points for each cluster
-            #pragma omp for
-            for (long long point = 0; point < (long long) data.size(); point++) {
-                const unsigned int cluster = point_clusters[point];
-                local_new_means[thread_id][cluster].x += data[point].x;
-                local_new_means[thread_id][cluster].y += data[point].y;
-                local_counts[thread_id][cluster] += 1;
-            }
+    std::ofstream fp;
+    fp.open(pathname, std::ofstream::out | std::ofstream::binary);
 
-            #pragma omp single
-            {
-                for (int i = 0; i < thread_nums; i++) {
-                    DataFrame local_new_mean = local_new_means[i];
-                    std::vector<long long> local_count = local_counts[i];
+    if (fp.is_open()) {
+        fp.write((const char*) &header, sizeof(header));
+        if (points.single()) {
+            fp.write((const char*) points.single_data(), points.size() * points.dimension() * sizeof(float));
+        } else {
+            fp.write((const char*) points.data(), points.size() * points.dimension() * sizeof(double));
+        }
+        fp.close();
+    } else {
+        perror("writebinary error");
+        return -1;
+    }
 
-                    for (unsigned int cluster = 0; cluster < k; cluster++) {
-                        new_means[cluster].x += local_new_mean[cluster].x;
-                        new_means[cluster].y += local_new_mean[cluster].y;
-                        counts[cluster] += local_count[cluster];
-                    }
-                }
-            }
+    return 0;
+}
 
-            // Divide sums by counts to get new centroids
-            #pragma omp for
-            for (unsigned int cluster = 0; cluster < k; cluster++) {
-                const long long count = std::max<long long>(1, counts[cluster]);
-                means[cluster].x = new_means[cluster].x / count;
-                means[cluster].y = new_means[cluster].y / count;
-            }
+// Collectively read <length> bytes at <offset>, in rounds so every rank joins the same number of calls
+static int read_at_all(MPI_File fh, MPI_Offset offset, char *buffer, MPI_Offset length) {
+    int status = 0;
+    MPI_Offset rounds = (length + IO_CHUNK - 1) / IO_CHUNK;
+    MPI_Allreduce(MPI_IN_PLACE, &rounds, 1, MPI_OFFSET, MPI_MAX, MPI_COMM_WORLD);
+
+    for (MPI_Offset round = 0; round < rounds; round++) {
+        const MPI_Offset start = std::min<MPI_Offset>(length, round * IO_CHUNK);
+        const int count = std::min<MPI_Offset>(IO_CHUNK, length - start);
+        if (MPI_File_read_at_all(fh, offset + start, buffer + start, count, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+            status = -1;
         }
     }
 
-    return means;
+    return status;
 }
 
-DataFrame kmeansMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters) {
+int readshard(std::string filename, DataFrame &points, bool binary) {
+    std::filesystem::path dir("inputs");
+    std::filesystem::path file(filename);
+    std::filesystem::path pathname = dir / file;
+
     int world_size, world_rank;
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
 
-    // Define own MPI struct type
-    MPI_Aint base_address;
-    MPI_Aint displacements[2];
-    MPI_Datatype point_type;
-    MPI_Datatype types[2] = { MPI_DOUBLE, MPI_DOUBLE };
-
-    struct Point point;
-    int lengths[2] = { 1, 1 };
- 
-    MPI_Get_address(&point, &base_address);
-    MPI_Get_address(&point.x, &displacements[0]);
-    MPI_Get_address(&point.y, &displacements[1]);
-    displacements[0] = MPI_Aint_diff(displacements[0], base_address);
-    displacements[1] = MPI_Aint_diff(displacements[1], base_address);
-    
-    MPI_Type_create_struct(2, lengths, displacements, types, &point_type);
-    MPI_Type_commit(&point_type);
-
-    // Define own MPI operation type
-    MPI_Op POINT_SUM;
-    MPI_Op_create((MPI_User_function *) point_sum, 1, &POINT_SUM);
-
-    // Pick centroids as random points from the dataset
-    static std::random_device seed;
-    static std::mt19937 random_number_generator(seed());
-    std::uniform_int_distribution<long long> indices(0, data.size() - 1);
-
-    DataFrame return_means(k);
-    Point *means = (Point*) calloc(k, sizeof(Point));
-
-    if (world_rank == MASTER) {
-        for (unsigned int i = 0; i < k; i++) {
-            means[i] = data[indices(random_number_generator)];
+    MPI_File fh;
+    if (MPI_File_open(MPI_COMM_WORLD, pathname.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        if (world_rank == MASTER) {
+            fprintf(stderr, "readshard error: cannot open %s\n", pathname.c_str());
         }
+        return -1;
     }
 
-    // Assign work
-    int points;
-    int offset;
-    int extra_points = data.size() % world_size;
-    int number_of_points = data.size() / world_size;
-
-    int *points_array = NULL;
-    int *offset_array = NULL;
+    MPI_Offset file_size;
+    MPI_File_get_size(fh, &file_size);
 
-    if (world_rank == MASTER) {
-        points_array = (int*) calloc(world_size, sizeof(int));
-        offset_array = (int*) calloc(world_size, sizeof(int));
+    int status = 0;
+    long long first = 0, count = 0, total = 0;
 
-        offset = 0;
-        for (int worker = 0; worker < world_size; worker++) {
-            points = (worker < extra_points)? number_of_points + 1: number_of_points;
-            points_array[worker] = points;
-            offset_array[worker] = offset;
-            offset += points;
+    if (binary) {
+        BinaryHeader header;
+        memset(&header, 0, sizeof(header));
+        if (file_size >= (MPI_Offset) sizeof(BinaryHeader)) {
+            MPI_File_read_at_all(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
         }
-    }
 
-    // MPI scatter the value of points and offset to every process
-    MPI_Scatter(&points_array[world_rank], 1, MPI_INT, &points, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
-    MPI_Scatter(&offset_array[world_rank], 1, MPI_INT, &offset, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+        // Every rank sees the same header, so they all agree on failing here
+        const size_t value_size = (header.dtype == DTYPE_FLOAT32)? sizeof(float): sizeof(double);
+        if (memcmp(header.magic, BINARY_MAGIC, sizeof(header.magic)) != 0 || header.version != BINARY_VERSION ||
+            (header.dtype != DTYPE_FLOAT64 && header.dtype != DTYPE_FLOAT32) || header.dimension == 0 ||
+            !holds_rows(header, file_size)) {
+            if (world_rank == MASTER) {
+                fprintf(stderr, "readshard error: %s is not a float64 or float32 point file\n", pathname.c_str());
+            }
+            MPI_File_close(&fh);
+            return -1;
+        }
 
-    // Local variable for each process
-    unsigned int *local_point_clusters = (unsigned int*) calloc(points, sizeof(unsigned int)); 
+        // Same split as before, the first (count % size) ranks take one extra point
+        total = header.count;
+        count = total / world_size + ((world_rank < total % world_size)? 1: 0);
+        first = world_rank * (total / world_size) + std::min<long long>(world_rank, total % world_size);
+
+        // float32 shards stay float32, so they take half the reading and half the memory
+        const size_t row_size = header.dimension * value_size;
+        if (header.dtype == DTYPE_FLOAT32) {
+            std::vector<float> values(count * header.dimension);
+            status = read_at_all(fh, sizeof(BinaryHeader) + first * row_size, (char*) values.data(), count * row_size);
+            points = DataFrame(std::move(values), header.dimension);
+        } else {
+            points = DataFrame(count, header.dimension);
+            status = read_at_all(fh, sizeof(BinaryHeader) + first * row_size, (char*) points.data(), count * row_size);
+        }
+    } else {
+        // Split by bytes, a rank owns every line that starts inside its range
+        MPI_Offset start = file_size * world_rank / world_size;
+        MPI_Offset end = file_size * (world_rank + 1) / world_size;
+        MPI_Offset begin = (start > 0)? start - 1: start;
+
+        // One byte before the range tells whether the range starts on a line boundary
+        std::vector<char> buffer(end - begin);
+        status = read_at_all(fh, begin, buffer.data(), end - begin);
+
+        // Finish the line that crosses the end of the range
+        while (status == 0 && start < end && end < file_size && buffer.back() != '\n') {
+            char block[4096];
+            const int length = std::min<MPI_Offset>(sizeof(block), file_size - end);
+            if (MPI_File_read_at(fh, end, block, length, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+                status = -1;
+                break;
+            }
 
-    // MPI broadcast the value of means and change
-    MPI_Bcast(means, k, point_type, MASTER, MPI_COMM_WORLD);
+            const char *newline = (const char*) memchr(block, '\n', length);
+            const int used = (newline != NULL)? newline - block + 1: length;
+            buffer.insert(buffer.end(), block, block + used);
+            end += used;
+        }
 
-    for (int iteration = 0; iteration < ITERATIONS; iteration++) {
-        // Find the point belongs to which cluster
-        for (int point = 0; point < points; point++) {
-            long double best_distance = std::numeric_limits<double>::max();
-            unsigned int best_cluster = 0;
-            for (unsigned int cluster = 0; cluster < k; cluster++) {
-                const long double distance = squared_euclidean_distance(data[point + offset], means[cluster]);
-                if (distance < best_distance) {
-                    best_cluster = cluster;
-                    best_distance = distance;
-                }
-            }
+        size_t position = 0;
+        if (start > 0) {
+            const char *newline = (const char*) memchr(buffer.data(), '\n', buffer.size());
+            position = (newline != NULL)? newline - buffer.data() + 1: buffer.size();
+        }
 
-            local_point_clusters[point] = best_cluster;
+        buffer.push_back('\0');
+        std::vector<double> values;
+        unsigned int dimension = 0;
+        if (parse_points(buffer.data() + position, buffer.data() + buffer.size() - 1, values, dimension) == -1) {
+            status = -1;
         }
 
-        // Sum up and count points for each cluster
-        Point *new_means = NULL;
-        long long *counts = NULL;
-        Point *local_new_means = (Point*) calloc(k, sizeof(Point));
-        long long *local_counts = (long long*) calloc(k, sizeof(long long));
-
-        for (int point = 0; point < points; point++) {
-            const unsigned int cluster = local_point_clusters[point];
-            local_new_means[cluster].x += data[point].x;
-            local_new_means[cluster].y += data[point].y;
-            local_counts[cluster] += 1;
+        // Ranks without any rows take the dimension of the others
+        unsigned int dimensions[2] = { dimension, (dimension > 0)? dimension: std::numeric_limits<unsigned int>::max() };
+        MPI_Allreduce(MPI_IN_PLACE, &dimensions[0], 1, MPI_UNSIGNED, MPI_MAX, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &dimensions[1], 1, MPI_UNSIGNED, MPI_MIN, MPI_COMM_WORLD);
+        if (dimensions[1] != dimensions[0] && dimensions[1] != std::numeric_limits<unsigned int>::max()) {
+            if (world_rank == MASTER) {
+                fprintf(stderr, "readshard error: rows of %s do not share one dimension\n", pathname.c_str());
+            }
+            status = -1;
         }
 
+        points = DataFrame(std::move(values), dimensions[0]);
+
+        count = points.size();
+        MPI_Exscan(&count, &first, 1, MPI_LONG_LONG_INT, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(&count, &total, 1, MPI_LONG_LONG_INT, MPI_SUM, MPI_COMM_WORLD);
         if (world_rank == MASTER) {
-            new_means = (Point*) calloc(k, sizeof(Point));
-            counts = (long long*) calloc(k, sizeof(long long));
+            first = 0;
         }
+    }
 
-        MPI_Reduce(local_counts, counts, k, MPI_LONG_LONG_INT, MPI_SUM, MASTER, MPI_COMM_WORLD);
-        MPI_Reduce(local_new_means, new_means, k, point_type, POINT_SUM, MASTER, MPI_COMM_WORLD);
+    MPI_File_close(&fh);
 
-        // Divide sums by counts to get new centroids
+    MPI_Allreduce(MPI_IN_PLACE, &status, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (status == -1) {
         if (world_rank == MASTER) {
-            for (unsigned int cluster = 0; cluster < k; cluster++) {
-                const long long count = std::max<long long>(1, counts[cluster]);
-                means[cluster].x = new_means[cluster].x / count;
-                means[cluster].y = new_means[cluster].y / count;
-            }
+            fprintf(stderr, "readshard error: failed to read %s\n", pathname.c_str());
         }
+        return -1;
+    }
+
+    points.shard(first, total);
+
+    return 0;
+}
+
+// Collectively write <length> bytes at <offset>, in rounds like read_at_all
+static int write_at_all(MPI_File fh, MPI_Offset offset, const char *buffer, MPI_Offset length) {
+    int status = 0;
+    MPI_Offset rounds = (length + IO_CHUNK - 1) / IO_CHUNK;
+    MPI_Allreduce(MPI_IN_PLACE, &rounds, 1, MPI_OFFSET, MPI_MAX, MPI_COMM_WORLD);
+
+    for (MPI_Offset round = 0; round < rounds; round++) {
+        const MPI_Offset start = std::min<MPI_Offset>(length, round * IO_CHUNK);
+        const int count = std::min<MPI_Offset>(IO_CHUNK, length - start);
+        if (MPI_File_write_at_all(fh, offset + start, buffer + start, count, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+            status = -1;
+        }
+    }
+
+    return status;
+}
 
-        MPI_Bcast(means, k, point_type, MASTER, MPI_COMM_WORLD);
+// Open outputs/<filename> on every rank, emptied so a shorter result never keeps the tail of an older one
+static int open_output(std::string filename, MPI_File &fh) {
+    std::filesystem::path dir("outputs");
+    std::filesystem::path file(filename);
+    std::filesystem::path pathname = dir / file;
 
-        // Free the space
-        free(local_counts);
-        free(local_new_means);
+    int world_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    if (world_rank == MASTER && !std::filesystem::exists(dir)) {
+        mkdir(dir.c_str(), MODE);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
 
+    if (MPI_File_open(MPI_COMM_WORLD, pathname.c_str(), MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
         if (world_rank == MASTER) {
-            free(counts);
-            free(new_means);
+            fprintf(stderr, "writeshard error: cannot open %s\n", pathname.c_str());
         }
+        return -1;
     }
+    MPI_File_set_size(fh, 0);
+
+    return 0;
+}
 
-    MPI_Gather(local_point_clusters, points, MPI_UNSIGNED, point_clusters, points, MPI_UNSIGNED, MASTER, MPI_COMM_WORLD);
+int writeshard(std::string filename, DataFrame &points, unsigned int *point_clusters) {
+    // Every rank formats its own rows and writes them at the offset of the ranks before it, in one collective
+    std::vector<char> text;
+    format_rows(points, point_clusters, text);
 
-    // Copy the value of means to return_means
+    long long length = text.size(), offset = 0;
+    MPI_Exscan(&length, &offset, 1, MPI_LONG_LONG_INT, MPI_SUM, MPI_COMM_WORLD);
+
+    int world_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
     if (world_rank == MASTER) {
-        for (long unsigned int i = 0; i < k; i++) {
-            return_means[i] = means[i];
-        }
+        offset = 0;
+    }
 
-        free(points_array);
-        free(offset_array);
+    MPI_File fh;
+    if (open_output(filename, fh) == -1) {
+        return -1;
     }
 
-    MPI_Op_free(&POINT_SUM);
-    MPI_Type_free(&point_type);
+    int status = write_at_all(fh, offset, text.data(), length);
+    MPI_File_close(&fh);
 
-    free(means);
-    free(local_point_clusters);
+    MPI_Allreduce(MPI_IN_PLACE, &status, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
 
-    return return_means;
+    return status;
 }
 
-// hybrid = MPI + OMP
-DataFrame kmeansHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters) {
-    int world_size, world_rank;
-    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+// A BinaryHeader with RESULT_MAGIC (count points, dimension, k in reserved[0]), the k * dimension float64
+// centroids and then one uint32 label per point in file order
+static void result_header(BinaryHeader &header, size_t count, unsigned int dimension, unsigned int k) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RESULT_MAGIC, sizeof(header.magic));
+    header.version = RESULT_VERSION;
+    header.dtype = DTYPE_UINT32;
+    header.count = count;
+    header.dimension = dimension;
+    header.reserved[0] = k;
+}
+
+int writeresult(std::string filename, const DataFrame &points, const unsigned int *point_clusters, const DataFrame &means) {
+    std::filesystem::path dir("outputs");
+    std::filesystem::path file(filename);
+    std::filesystem::path pathname = dir / file;
+
+    if (!std::filesystem::exists(dir)) {
+        mkdir(dir.c_str(), MODE);
+    }
+
+    BinaryHeader header;
+    result_header(header, points.size(), means.dimension(), means.size());
+
+    std::ofstream fp;
+    fp.open(pathname, std::ofstream::out | std::ofstream::binary);
+
+    if (fp.is_open()) {
+        fp.write((const char*) &header, sizeof(header));
+        fp.write((const char*) means.data(), means.size() * means.dimension() * sizeof(double));
+        fp.write((const char*) point_clusters, points.size() * sizeof(unsigned int));
+        fp.close();
+    } else {
+        perror("writeresult error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int writeresultshard(std::string filename, const DataFrame &points, const unsigned int *point_clusters, const DataFrame &means) {
+    int world_rank;
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
 
-    // Define own MPI struct type
-    MPI_Aint base_address;
-    MPI_Aint displacements[2];
-    MPI_Datatype point_type;
-    MPI_Datatype types[2] = { MPI_DOUBLE, MPI_DOUBLE };
-
-    struct Point point;
-    int lengths[2] = { 1, 1 };
- 
-    MPI_Get_address(&point, &base_address);
-    MPI_Get_address(&point.x, &displacements[0]);
-    MPI_Get_address(&point.y, &displacements[1]);
-    displacements[0] = MPI_Aint_diff(displacements[0], base_address);
-    displacements[1] = MPI_Aint_diff(displacements[1], base_address);
-    
-    MPI_Type_create_struct(2, lengths, displacements, types, &point_type);
-    MPI_Type_commit(&point_type);
-
-    // Define own MPI operation type
-    MPI_Op POINT_SUM;
-    MPI_Op_create((MPI_User_function *) point_sum, 1, &POINT_SUM);
-
-    // Pick centroids as random points from the dataset
-    static std::random_device seed;
-    static std::mt19937 random_number_generator(seed());
-    std::uniform_int_distribution<long long> indices(0, data.size() - 1);
-
-    DataFrame return_means(k);
-    Point *means = (Point*) calloc(k, sizeof(Point));
+    MPI_File fh;
+    if (open_output(filename, fh) == -1) {
+        return -1;
+    }
+
+    // The master writes the header and the centroids, every rank its labels at the global offset of its shard
+    BinaryHeader header;
+    result_header(header, points.total(), means.dimension(), means.size());
+    const MPI_Offset labels = sizeof(header) + (MPI_Offset) means.size() * means.dimension() * sizeof(double);
 
+    int status = 0;
     if (world_rank == MASTER) {
-        for (unsigned int i = 0; i < k; i++) {
-            means[i] = data[indices(random_number_generator)];
+        if (MPI_File_write_at(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS ||
+            MPI_File_write_at(fh, sizeof(header), means.data(), means.size() * means.dimension(), MPI_DOUBLE, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+            status = -1;
         }
     }
 
-    // Assign work
-    int points;
-    int offset;
-    int extra_points = data.size() % world_size;
-    int number_of_points = data.size() / world_size;
+    if (write_at_all(fh, labels + points.offset() * sizeof(unsigned int), (const char*) point_clusters,
+                     points.size() * sizeof(unsigned int)) == -1) {
+        status = -1;
+    }
+    MPI_File_close(&fh);
 
-    int *points_array = NULL;
-    int *offset_array = NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &status, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
 
-    if (world_rank == MASTER) {
-        points_array = (int*) calloc(world_size, sizeof(int));
-        offset_array = (int*) calloc(world_size, sizeof(int));
+    return status;
+}
 
-        offset = 0;
-        for (int worker = 0; worker < world_size; worker++) {
-            points = (worker < extra_points)? number_of_points + 1: number_of_points;
-            points_array[worker] = points;
-            offset_array[worker] = offset;
-            offset += points;
-        }
+double calculate_time(const struct timespec &starttime, const struct timespec &endtime) {
+        double elapsed;
+        elapsed = endtime.tv_sec - starttime.tv_sec;
+        elapsed += (endtime.tv_nsec - starttime.tv_nsec) / 1000000000.0;
+        return elapsed;
+}
+
+
+bool should_stop(const KMeansOptions &options, KMeansSummary &summary, long long changed, double inertia, double shift) {
+    // Every point counts as changed in the first iteration, so only the shift can stop it.
+    // A negative count means the engine does not know it, which leaves the other rules. A resumed run
+    // starts from a count of -1 too, its labels are not checkpointed and its first iteration relabels all points.
+    const bool first = (summary.iterations == 0);
+    const bool relabelled = first || summary.changed < 0;
+    const double previous_inertia = summary.inertia;
+
+    summary.iterations += 1;
+    summary.changed = changed;
+    summary.inertia = inertia;
+    summary.shift = shift;
+
+    if (options.tolerance >= 0 && shift <= options.tolerance) {
+        summary.converged = true;
+    } else if (!relabelled && options.min_changed >= 0 && changed >= 0 && changed <= options.min_changed) {
+        summary.converged = true;
+    } else if (!first && options.inertia_tolerance >= 0 && fabs(previous_inertia - inertia) <= options.inertia_tolerance * inertia) {
+        summary.converged = true;
     }
 
-    // MPI scatter the value of points and offset to every process
-    MPI_Scatter(&points_array[world_rank], 1, MPI_INT, &points, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
-    MPI_Scatter(&offset_array[world_rank], 1, MPI_INT, &offset, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+    return summary.converged;
+}
 
-    // Local variable for each process
-    unsigned int *node_point_clusters = (unsigned int*) calloc(points, sizeof(unsigned int)); 
+Accumulators::Accumulators(int threads, unsigned int k, unsigned int dimension)
+    : values((size_t) k * dimension), length(values + k + 2) {
+    const size_t align = numa_on? PAGE_SIZE: CACHE_LINE;
+    stride = (length * sizeof(double) + align - 1) / align * align;
+    arena = (char*) aligned_alloc(align, threads * stride);
+}
 
-    // MPI broadcast the value of means and change
-    MPI_Bcast(means, k, point_type, MASTER, MPI_COMM_WORLD);
+Accumulators::~Accumulators() {
+    free(arena);
+}
 
-    for (int iteration = 0; iteration < ITERATIONS; iteration++) {
-        std::vector<DataFrame> thrd_new_means;
-        std::vector<std::vector<long long>> thrd_counts;
-        Point *node_new_means = (Point*) calloc(k, sizeof(Point));
-        long long *node_counts = (long long*) calloc(k, sizeof(long long));
+void Accumulators::clear(int thread) {
+    memset(arena + (size_t) thread * stride, 0, stride);
+}
+
+// Pairwise tree, log2(threads) rounds in which half of the remaining slices fold into the other half
+void Accumulators::reduce(int thread, int threads) {
+    #pragma omp barrier
+    for (int step = 1; step < threads; step *= 2) {
+        if (thread % (2 * step) == 0 && thread + step < threads) {
+            double *slice = sums(thread);
+            const double *other = sums(thread + step);
+            for (size_t i = 0; i < length; i++) {
+                slice[i] += other[i];
+            }
+        }
+        #pragma omp barrier
+    }
+}
+
+// Find the rows [begin, end) belong to which cluster and sum them up per cluster in the same sweep,
+// the totals of the sweep are left in slice 0 of <accumulators>. With <delta> only the rows that changed
+// cluster are summed, into their new cluster and negated into their old one, see RunningTotals. P is how
+// the rows are stored, the sums are always doubles.
+template <typename P>
+static void assign_points(const DataFrame &data, long long begin, long long end, Nearest<P> nearest, const Centroids &packed,
+                          CentroidReplicas &replicas, unsigned int *point_clusters, bool first, bool delta,
+                          Accumulators &accumulators, bool parallel) {
+    const unsigned int k = packed.k, dimension = packed.dimension;
+
+    #pragma omp parallel if(parallel)
+    {
+        const int thread_id = omp_get_thread_num();
+        const Centroids &centroids = replicas.local(packed);
+        double *sums = accumulators.sums(thread_id);
+        double *counts = accumulators.counts(thread_id);
+        double changed = 0, inertia = 0;
+        accumulators.clear(thread_id);
 
-        #pragma omp parallel
         {
-            const int thread_id = omp_get_thread_num();
-            const int thread_nums = omp_get_num_threads();
-            
-            #pragma omp single
-            {
-                for (int i = 0; i < thread_nums; i++) {
-                    DataFrame thrd_new_mean(k);
-                    std::vector<long long> thrd_count(k, 0);
-                    thrd_new_means.push_back(thrd_new_mean);
-                    thrd_counts.push_back(thrd_count);
+            TraceSpan span(TRACE_ASSIGN);
+            // Static like DataFrame::place, so with --numa every thread sweeps rows on its own node
+            #pragma omp for schedule(static) nowait
+            for (long long point = begin; point < end; point++) {
+                double distance;
+                const P *row = data.row<P>(point);
+                const unsigned int cluster = nearest(row, centroids, &distance);
+                const unsigned int previous = point_clusters[point];
+                if (first || cluster != previous) {
+                    changed += 1;
                 }
-            }
+                point_clusters[point] = cluster;
+                inertia += distance;
 
-            // Find the point belongs to which cluster
-            #pragma omp for
-            for (int point = 0; point < points; point++) {
-                long double best_distance = std::numeric_limits<double>::max();
-                unsigned int best_cluster = 0;
-                for (unsigned int cluster = 0; cluster < k; cluster++) {
-                    const long double distance = squared_euclidean_distance(data[point + offset], means[cluster]);
-                    if (distance < best_distance) {
-                        best_cluster = cluster;
-                        best_distance = distance;
+                if (!delta) {
+                    for (unsigned int d = 0; d < dimension; d++) {
+                        sums[cluster * dimension + d] += row[d];
                     }
+                    counts[cluster] += 1;
+                } else if (cluster != previous) {
+                    for (unsigned int d = 0; d < dimension; d++) {
+                        sums[cluster * dimension + d] += row[d];
+                        sums[previous * dimension + d] -= row[d];
+                    }
+                    counts[cluster] += 1;
+                    counts[previous] -= 1;
                 }
-
-                node_point_clusters[point] = best_cluster;
             }
+        }
 
-            // Sum up and count points for each cluster
-            #pragma omp for
-            for (int point = 0; point < points; point++) {
-                const unsigned int cluster = node_point_clusters[point];
-                thrd_new_means[thread_id][cluster].x += data[point].x;
-                thrd_new_means[thread_id][cluster].y += data[point].y;
-                thrd_counts[thread_id][cluster] += 1;
-            }
+        counts[k + TOTAL_CHANGED] = changed;
+        counts[k + TOTAL_INERTIA] = inertia;
 
-            #pragma omp single
-            {
-                for (int i = 0; i < thread_nums; i++) {
-                    DataFrame thrd_new_mean = thrd_new_means[i];
-                    std::vector<long long> thrd_count = thrd_counts[i];
+        TraceSpan span(TRACE_REDUCE);
+        accumulators.reduce(thread_id, omp_get_num_threads());
+    }
+}
 
-                    for (unsigned int cluster = 0; cluster < k; cluster++) {
-                        node_new_means[cluster].x += thrd_new_mean[cluster].x;
-                        node_new_means[cluster].y += thrd_new_mean[cluster].y;
-                        node_counts[cluster] += thrd_count[cluster];
-                    }
-                }
-            }
+// Divide sums by counts to get new centroids, returns how far the furthest one moved
+double update_means(double *means, const double *sums, const double *counts, unsigned int k, unsigned int dimension, bool parallel) {
+    double shift = 0;
+    #pragma omp parallel for reduction(max:shift) if(parallel)
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        const double count = std::max(1.0, counts[cluster]);
+        double moved = 0;
+        for (unsigned int d = 0; d < dimension; d++) {
+            const double value = sums[cluster * dimension + d] / count;
+            moved += square(value - means[cluster * dimension + d]);
+            means[cluster * dimension + d] = value;
         }
-        
-        Point *new_means = NULL;
-        long long *counts = NULL;
+        shift = std::max(shift, sqrt(moved));
+    }
 
-        if (world_rank == MASTER) {
-            new_means = (Point*) calloc(k, sizeof(Point));
-            counts = (long long*) calloc(k, sizeof(long long));
+    return shift;
+}
+
+// Serial and OMP share everything but the threads of the sweep
+template <typename P>
+static DataFrame kmeans_shared(const DataFrame &data, unsigned int k, unsigned int *point_clusters,
+                               const KMeansOptions &options, KMeansSummary &summary, bool parallel) {
+    const unsigned int dimension = data.dimension();
+    const bool single = (options.precision == "float");
+    const Nearest<P> nearest = select_nearest<P>(dimension, single);
+    Centroids centroids;
+    CentroidReplicas replicas;
+    summary = KMeansSummary();
+
+    // Seed the centroids with the chosen initializer, unless a checkpoint has them
+    DataFrame means(k, dimension);
+    Checkpoint checkpoint(options, k, dimension, false);
+    int first_iteration = checkpoint.resume(means.data(), summary);
+    if (first_iteration < 0) {
+        TraceSpan span(TRACE_SEED);
+        initialize_means(data, k, dimension, means.data(), options, false, parallel);
+        first_iteration = 0;
+    }
+
+    // Thread partials live in one arena for the whole run
+    Accumulators accumulators(parallel? omp_get_max_threads(): 1, k, dimension);
+    const double *totals = accumulators.counts(0);
+    RunningTotals running(k, dimension, options.incremental, first_iteration);
+
+    // With --sort-every the sweep reads the rows grouped by cluster, so the same sums stay hot
+    ClusterSort sorter(data, point_clusters, k, options.sort_every, first_iteration);
+
+    for (int iteration = first_iteration; iteration < options.max_iterations; iteration++) {
+        // Lay the current centroids out for the assignment kernel
+        centroids.pack(means.data(), k, dimension, single);
+        replicas.refresh();
+        sorter.sort(iteration, parallel);
+
+        trace_iteration(iteration);
+        assign_points(sorter.rows(), 0, data.size(), nearest, centroids, replicas, sorter.labels(), iteration == first_iteration,
+                      !running.full(iteration), accumulators, parallel);
+
+        double shift;
+        {
+            TraceSpan span(TRACE_UPDATE);
+            running.apply(iteration, accumulators.sums(0));
+            shift = update_means(means.data(), accumulators.sums(0), totals, k, dimension, parallel);
         }
 
-        MPI_Reduce(node_counts, counts, k, MPI_LONG_LONG_INT, MPI_SUM, MASTER, MPI_COMM_WORLD);
-        MPI_Reduce(node_new_means, new_means, k, point_type, POINT_SUM, MASTER, MPI_COMM_WORLD);
+        summary.distance_evaluations += (long long) data.size() * k;
+        trace_count(TRACE_CHANGED, totals[k + TOTAL_CHANGED]);
+        trace_count(TRACE_INERTIA, totals[k + TOTAL_INERTIA]);
+        trace_count(TRACE_SHIFT, shift);
 
-        // Divide sums by counts to get new centroids
-        if (world_rank == MASTER) {
-            for (unsigned int cluster = 0; cluster < k; cluster++) {
-                const long long count = std::max<long long>(1, counts[cluster]);
-                means[cluster].x = new_means[cluster].x / count;
-                means[cluster].y = new_means[cluster].y / count;
+        if (should_stop(options, summary, totals[k + TOTAL_CHANGED], totals[k + TOTAL_INERTIA], shift)) {
+            break;
+        }
+        checkpoint.save(iteration + 1, means.data(), summary);
+    }
+
+    sorter.finish(parallel);
+    return means;
+}
+
+// Add a reduced chunk to the totals of the iteration once it has arrived
+static void land_chunk(MPI_Request &request, const double *received, std::vector<double> &totals) {
+    if (request == MPI_REQUEST_NULL) {
+        return;
+    }
+
+    MPI_Wait(&request, MPI_STATUS_IGNORE);
+    for (size_t i = 0; i < totals.size(); i++) {
+        totals[i] += received[i];
+    }
+}
+
+// MPI and hybrid share everything but the threads of the sweep. The sums, counts, changed points and
+// inertia of a shard travel in one buffer and a single MPI_Allreduce, then every rank divides them itself.
+template <typename P>
+static DataFrame kmeans_distributed(const DataFrame &data, unsigned int k, unsigned int *point_clusters,
+                                    const KMeansOptions &options, KMeansSummary &summary, bool parallel) {
+    // Shards agree on the dimension, ranks without rows learn it from the others
+    unsigned int dimension = data.dimension();
+    MPI_Allreduce(MPI_IN_PLACE, &dimension, 1, MPI_UNSIGNED, MPI_MAX, options.comm);
+    const bool single = (options.precision == "float");
+    const Nearest<P> nearest = select_nearest<P>(dimension, single);
+    Centroids centroids;
+    CentroidReplicas replicas;
+    summary = KMeansSummary();
+    const int values = k * dimension;
+
+    // Seed the centroids from every shard with the chosen initializer, unless a checkpoint has them
+    DataFrame means(k, dimension);
+    Checkpoint checkpoint(options, k, dimension, true);
+    int first_iteration = checkpoint.resume(means.data(), summary);
+    if (first_iteration < 0) {
+        TraceSpan span(TRACE_SEED);
+        initialize_means(data, k, dimension, means.data(), options, true, parallel);
+        first_iteration = 0;
+    }
+
+    // Each process works on the shard it loaded, or on the range --balance gave it
+    LoadBalancer balancer(data, point_clusters, dimension, options.balance, options.comm);
+    long long points = data.size();
+
+    // Thread partials live in one arena and the totals in one buffer for the whole run
+    Accumulators accumulators(parallel? omp_get_max_threads(): 1, k, dimension);
+    const int size = accumulators.size();
+    std::vector<double> totals(size);
+    const double *counts = &totals[values];
+
+    // Ranks sharing a node add their totals up in shared memory before the collective between nodes
+    NodeReduction reduction(options.comm, size);
+    RunningTotals running(k, dimension, options.incremental, first_iteration);
+
+    // Grouping by cluster reorders the shard in place of the balancer, the two do not combine
+    const int sort_every = (options.balance > 0)? 0: options.sort_every;
+    ClusterSort sorter(data, point_clusters, k, sort_every, first_iteration);
+
+    // With overlap the shard is swept in chunks, two of them reducing while the next one is assigned
+    const unsigned int chunks = std::max(1u, options.overlap);
+    std::vector<double> sent(2 * size), received(2 * size);
+    MPI_Request requests[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+
+    for (int iteration = first_iteration; iteration < options.max_iterations; iteration++) {
+        // Lay the current centroids out for the assignment kernel
+        centroids.pack(means.data(), k, dimension, single);
+        replicas.refresh();
+
+        trace_iteration(iteration);
+        sorter.sort(iteration, parallel);
+        const DataFrame &rows = (sort_every > 0)? sorter.rows(): balancer.rows();
+        unsigned int *labels = (sort_every > 0)? sorter.labels(): balancer.labels();
+        const double iteration_begin = MPI_Wtime();
+        double assign_time = 0, wait_time = 0;
+
+        if (options.overlap == 0) {
+            double begin = MPI_Wtime();
+            assign_points(rows, 0, points, nearest, centroids, replicas, labels, iteration == first_iteration,
+                          !running.full(iteration), accumulators, parallel);
+            assign_time += MPI_Wtime() - begin;
+
+            // Late iterations move few points, so their deltas travel as records of the clusters they touched
+            TraceSpan span(TRACE_COMMUNICATE);
+            begin = MPI_Wtime();
+            if (running.full(iteration) || !running.exchange(accumulators.sums(0), totals.data(), 2, options.comm)) {
+                reduction.allreduce(accumulators.sums(0), totals.data());
+            }
+            wait_time += MPI_Wtime() - begin;
+        } else {
+            std::fill(totals.begin(), totals.end(), 0.0);
+
+            // Every rank splits its shard into the same number of chunks, so the collectives pair up
+            for (unsigned int chunk = 0; chunk < chunks; chunk++) {
+                const long long begin = points * chunk / chunks, end = points * (chunk + 1) / chunks;
+                double started = MPI_Wtime();
+                assign_points(rows, begin, end, nearest, centroids, replicas, labels, iteration == first_iteration,
+                              !running.full(iteration), accumulators, parallel);
+                assign_time += MPI_Wtime() - started;
+
+                TraceSpan span(TRACE_COMMUNICATE);
+                const int slot = chunk % 2;
+                started = MPI_Wtime();
+                land_chunk(requests[slot], &received[slot * size], totals);
+                wait_time += MPI_Wtime() - started;
+                std::copy_n(accumulators.sums(0), size, &sent[slot * size]);
+                MPI_Iallreduce(&sent[slot * size], &received[slot * size], size, MPI_DOUBLE, MPI_SUM, options.comm, &requests[slot]);
+            }
+
+            TraceSpan span(TRACE_COMMUNICATE);
+            const double started = MPI_Wtime();
+            for (unsigned int chunk = chunks; chunk < chunks + 2; chunk++) {
+                land_chunk(requests[chunk % 2], &received[(chunk % 2) * size], totals);
             }
+            wait_time += MPI_Wtime() - started;
         }
 
-        MPI_Bcast(means, k, point_type, MASTER, MPI_COMM_WORLD);
+        // Every rank holds the same totals, so they all compute the same centroids and stop in the same iteration
+        double shift;
+        {
+            TraceSpan span(TRACE_UPDATE);
+            running.apply(iteration, totals.data());
+            shift = update_means(means.data(), totals.data(), counts, k, dimension, parallel);
+        }
 
-        // Free the space
-        free(node_counts);
-        free(node_new_means);
+        summary.distance_evaluations += (long long) data.total() * k;
+        trace_count(TRACE_CHANGED, counts[k + TOTAL_CHANGED]);
+        trace_count(TRACE_INERTIA, counts[k + TOTAL_INERTIA]);
+        trace_count(TRACE_SHIFT, shift);
 
-        if (world_rank == MASTER) {
-            free(counts);
-            free(new_means);
+        balancer.record(assign_time, wait_time, MPI_Wtime() - iteration_begin);
+        if (should_stop(options, summary, counts[k + TOTAL_CHANGED], counts[k + TOTAL_INERTIA], shift)) {
+            break;
+        }
+        checkpoint.save(iteration + 1, means.data(), summary);
+
+        // Every rank stops in the same iteration, so they all join the same rebalances
+        if (balancer.rebalance(iteration)) {
+            points = balancer.rows().size();
         }
     }
 
-    MPI_Gather(node_point_clusters, points, MPI_UNSIGNED, point_clusters, points, MPI_UNSIGNED, MASTER, MPI_COMM_WORLD);
+    sorter.finish(parallel);
+    balancer.finish(summary);
 
-    // Copy the value of means to return_means
-    if (world_rank == MASTER) {
-        for (long unsigned int i = 0; i < k; i++) {
-            return_means[i] = means[i];
-        }
+    return means;
+}
+
+DataFrame kmeansSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (data.single()) {
+        return kmeans_shared<float>(data, k, point_clusters, options, summary, false);
+    }
+    return kmeans_shared<double>(data, k, point_clusters, options, summary, false);
+}
 
-        free(points_array);
-        free(offset_array);
+DataFrame kmeansOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (data.single()) {
+        return kmeans_shared<float>(data, k, point_clusters, options, summary, true);
     }
+    return kmeans_shared<double>(data, k, point_clusters, options, summary, true);
+}
 
-    MPI_Op_free(&POINT_SUM);
-    MPI_Type_free(&point_type);
+DataFrame kmeansMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (data.single()) {
+        return kmeans_distributed<float>(data, k, point_clusters, options, summary, false);
+    }
+    return kmeans_distributed<double>(data, k, point_clusters, options, summary, false);
+}
 
-    free(means);
-    free(node_point_clusters);
+// hybrid = MPI + OMP
+DataFrame kmeansHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (data.single()) {
+        return kmeans_distributed<float>(data, k, point_clusters, options, summary, true);
+    }
+    return kmeans_distributed<double>(data, k, point_clusters, options, summary, true);
+}
+
+// Every algorithm with its engine per command, NULL where the combination is not available.
+// Shared by the kmeans program and the benchmark.
+static const struct {
+    const char *algorithm;
+    KMeans serial, omp, mpi, hybrid;
+} engines[] = {
+    { "lloyd"    , kmeansSerial         , kmeansOMP         , kmeansMPI         , kmeansHybrid          },
+    { "elkan"    , kmeansElkanSerial    , kmeansElkanOMP    , kmeansElkanMPI    , kmeansElkanHybrid     },
+    { "hamerly"  , kmeansHamerlySerial  , kmeansHamerlyOMP  , kmeansHamerlyMPI  , kmeansHamerlyHybrid   },
+    { "yinyang"  , kmeansYinyangSerial  , kmeansYinyangOMP  , kmeansYinyangMPI  , kmeansYinyangHybrid   },
+    { "minibatch", kmeansMiniBatchSerial, kmeansMiniBatchOMP, kmeansMiniBatchMPI, kmeansMiniBatchHybrid },
+    { "kdtree"   , kmeansKdTreeSerial   , kmeansKdTreeOMP   , kmeansKdTreeMPI   , kmeansKdTreeHybrid    },
+};
+
+KMeans find_engine(const std::string &algorithm, const std::string &command) {
+    for (const auto &engine : engines) {
+        if (algorithm == engine.algorithm) {
+            if (command == "serial") {
+                return engine.serial;
+            } else if (command == "omp") {
+                return engine.omp;
+            } else if (command == "mpi") {
+                return engine.mpi;
+            } else if (command == "hybrid") {
+                return engine.hybrid;
+            }
+        }
+    }
 
-    return return_means;
+    return NULL;
 }
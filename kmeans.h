@@ -5,32 +5,388 @@
 #include <vector>
 #include <string>
 #include <limits>
+#include <memory>
+#include <stdint.h>
 
-#define DataFrame std::vector<Point>
+#define BINARY_MAGIC    "KMPOINTS"
+#define BINARY_VERSION  1
+#define DTYPE_FLOAT64   0
+#define DTYPE_FLOAT32   1
+#define DTYPE_UINT32    2   // labels of a result file
+#define RESULT_MAGIC    "KMRESULT"
+#define RESULT_VERSION  1
 
-struct Point {
-    double x, y; 
+// Header of the binary point file, followed by count * dimension values of dtype
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint64_t count;
+    uint32_t dimension;
+    uint32_t reserved[9];
+};
+
+static_assert(sizeof(BinaryHeader) == 64, "binary header must stay 64 bytes");
+
+// Row-major matrix of points, either owned by the frame or viewed in place from a memory-mapped file.
+// The rows are float64, or float32 once narrowed (or mapped from a float32 file): the double accessors
+// are only valid for the former, single_data() for the latter and row<T>() for whichever the frame holds.
+class DataFrame {
+public:
+    DataFrame() {}
+    DataFrame(size_t size, unsigned int dimension) : values(size * dimension), count(size), dims(dimension) {}
+    DataFrame(std::vector<double> &&values, unsigned int dimension)
+        : values(std::move(values)), count((dimension > 0)? this->values.size() / dimension: 0), dims(dimension) {}
+    DataFrame(std::vector<float> &&values, unsigned int dimension)
+        : single_values(std::move(values)), count((dimension > 0)? single_values.size() / dimension: 0), dims(dimension),
+          is_single(true) {}
+
+    size_t size() const { return count; }
+    unsigned int dimension() const { return dims; }
+    double *data() { return mapping ? mapped : values.data(); }
+    const double *data() const { return mapping ? mapped : values.data(); }
+    double *operator[](size_t i) { return data() + i * dims; }
+    const double *operator[](size_t i) const { return data() + i * dims; }
+
+    bool single() const { return is_single; }
+    const float *single_data() const { return mapping ? single_mapped : single_values.data(); }
+    template <typename T> const T *row(size_t i) const;
+    double at(size_t i, unsigned int d) const { return is_single? single_data()[i * dims + d]: data()[i * dims + d]; }
+
+    // Switch the rows to float32 or back to float64, the old copy is released
+    void narrow();
+    void widen();
+
+    // Reorder the rows in place so row i becomes the current row order[i], one row of scratch at a time
+    void permute(const std::vector<size_t> &order);
 
-    Point() {
-        this->x = 0;
-        this->y = 0;
+    // Copy the rows onto pages first written by the OpenMP thread whose static share sweeps them, so each
+    // thread finds its rows on its own NUMA node. The old copy is released, see numa.h.
+    void place();
+
+    // Reshape the owned rows, the capacity is kept so a frame reused for chunks stops allocating
+    void resize(size_t size, unsigned int dimension) {
+        values.resize(size * dimension);
+        count = size;
+        dims = dimension;
+    }
+
+    void map(std::shared_ptr<void> region, double *begin, size_t size, unsigned int dimension) {
+        values.clear();
+        mapping = region;
+        mapped = begin;
+        count = size;
+        dims = dimension;
     }
 
-    Point(double x, double y) {
-        this->x = x;
-        this->y = y;
+    void map(std::shared_ptr<void> region, float *begin, size_t size, unsigned int dimension) {
+        single_values.clear();
+        mapping = region;
+        single_mapped = begin;
+        count = size;
+        dims = dimension;
+        is_single = true;
     }
+
+    // Global placement of these rows when the frame is one rank's shard of a larger dataset
+    size_t offset() const { return shard_offset; }
+    size_t total() const { return sharded ? shard_total : size(); }
+
+    void shard(size_t offset, size_t total) {
+        sharded = true;
+        shard_offset = offset;
+        shard_total = total;
+    }
+
+private:
+    std::vector<double> values;
+    std::vector<float> single_values;
+    size_t count = 0;
+    unsigned int dims = 0;
+    bool is_single = false;
+    bool sharded = false;
+    size_t shard_offset = 0;
+    size_t shard_total = 0;
+    std::shared_ptr<void> mapping;
+    double *mapped = NULL;
+    float *single_mapped = NULL;
+};
+
+template <>
+inline const double *DataFrame::row<double>(size_t i) const { return (*this)[i]; }
+
+template <>
+inline const float *DataFrame::row<float>(size_t i) const { return single_data() + i * dims; }
+
+#define DOUBLE_LANES    8   // centroids per block, one 512-bit register of doubles
+#define SINGLE_LANES    16  // same for floats
+
+// Centroids laid out for the assignment kernel: blocks of LANES centroids stored dimension by dimension,
+// so one vector instruction compares a point coordinate with a whole block. k is padded with infinity.
+struct Centroids {
+    unsigned int k = 0;
+    unsigned int dimension = 0;
+    unsigned int blocks = 0;
+    bool single = false;            // float arithmetic instead of double
+    std::vector<double> values;
+    std::vector<float> single_values;
+
+    void pack(const double *means, unsigned int k, unsigned int dimension, bool single = false);
+};
+
+// Index of the closest packed centroid to a point of type P, its squared distance goes to <distance>
+template <typename P>
+using Nearest = unsigned int (*)(const P *point, const Centroids &centroids, double *distance);
+typedef Nearest<double> NearestCentroid;
+
+// Kernel for points of type P, float32 points always use float arithmetic and ignore <single>
+template <typename P>
+Nearest<P> select_nearest(unsigned int dimension, bool single);
+template <>
+Nearest<double> select_nearest<double>(unsigned int dimension, bool single);
+template <>
+Nearest<float> select_nearest<float>(unsigned int dimension, bool single);
+
+#define CACHE_LINE      64
+#define TOTAL_CHANGED   0   // slots after the k counts
+#define TOTAL_INERTIA   1
+
+// Per-thread sums and counts of one iteration, carved out of a single arena allocated once per run.
+// A slice holds k * dimension sums, then k counts followed by the changed points and the inertia, all
+// doubles so one MPI_Allreduce combines them, and it is padded to whole cache lines so threads never share one.
+// With --numa the slices are padded to whole pages instead, each one first cleared by its own thread.
+class Accumulators {
+public:
+    Accumulators(int threads, unsigned int k, unsigned int dimension);
+    ~Accumulators();
+    Accumulators(const Accumulators&) = delete;
+    Accumulators &operator=(const Accumulators&) = delete;
+
+    size_t size() const { return length; }
+    double *sums(int thread) { return (double*) (arena + (size_t) thread * stride); }
+    double *counts(int thread) { return sums(thread) + values; }
+
+    // Both are called by every thread of the team, reduce leaves the totals in slice 0
+    void clear(int thread);
+    void reduce(int thread, int threads);
+
+private:
+    size_t values;
+    size_t length;
+    size_t stride;
+    char *arena;
 };
 
+// MPI_Allreduce of <length> doubles over <comm> in two levels. The ranks of a node, found with
+// MPI_Comm_split_type, add their values up in an MPI_Win_allocate_shared segment, so only one rank per node
+// takes part in the collective between nodes. When every node holds a single rank it falls back to a plain
+// MPI_Allreduce.
+class NodeReduction {
+public:
+    NodeReduction(MPI_Comm comm, size_t length);
+    ~NodeReduction();
+    NodeReduction(const NodeReduction&) = delete;
+    NodeReduction &operator=(const NodeReduction&) = delete;
+
+    // Collective over comm, like MPI_Allreduce(values, result, length, MPI_DOUBLE, MPI_SUM, comm)
+    void allreduce(const double *values, double *result);
+
+private:
+    void synchronize();
+
+    MPI_Comm comm;
+    MPI_Comm node_comm = MPI_COMM_NULL;
+    MPI_Comm leader_comm = MPI_COMM_NULL;
+    MPI_Win window = MPI_WIN_NULL;
+    int node_rank = 0;
+    int node_size = 1;
+    size_t length;
+    double *slots = NULL;
+    double *totals = NULL;
+};
+
+// Running per-cluster sums and counts of an --incremental run. Every <every> iterations, and in the first one,
+// the engines sum all points as usual; in between they only add the points that changed cluster to their new
+// cluster and take them off the old one, and these deltas go onto the totals of the previous iteration. The
+// buffers hold k * dimension sums, then k counts, then <extra> per-iteration values that are never carried over.
+class RunningTotals {
+public:
+    RunningTotals(unsigned int k, unsigned int dimension, int every, int first_iteration);
+
+    // Whether <iteration> sums every point rather than the changed ones
+    bool full(int iteration) const { return every <= 0 || (iteration - first_iteration) % every == 0; }
+
+    // Turn the reduced sums and counts of <iteration> into totals in place, and keep them for the next one
+    void apply(int iteration, double *reduced);
+
+    // Collective over comm: add up the deltas of every rank as (cluster, count, sums) records of the clusters
+    // they touched, gathered with MPI_Allgatherv and added in rank order, so every rank gets the same totals.
+    // Returns false without reducing when the records would outweigh the dense buffer.
+    bool exchange(const double *deltas, double *reduced, size_t extra, MPI_Comm comm);
+
+private:
+    unsigned int k;
+    unsigned int dimension;
+    int every;
+    int first_iteration;
+    std::vector<double> totals;
+    std::vector<double> records;
+    std::vector<double> gathered;
+};
+
+// Stopping rules shared by every engine, a negative threshold disables its rule
+struct KMeansOptions {
+    int max_iterations = 100;
+    double tolerance = 0;           // largest centroid shift
+    long long min_changed = 0;      // points that changed cluster
+    double inertia_tolerance = 0;   // relative change of the inertia
+    std::string init = "kmeans++";  // "random", "kmeans++" or "kmeans||"
+    unsigned long long seed = 0;
+    unsigned int groups = 0;        // centroid groups of yinyang, 0 picks k / 10
+    std::string precision = "double";  // arithmetic of the assignment kernel, "double" or "float"
+    long long batch_size = 1024;    // points drawn per iteration by "minibatch", over all the shards
+    bool final_assignment = true;   // label every point once "minibatch" is done
+    size_t chunk_size = 1 << 16;    // points held in memory at once by the "stream" command
+    unsigned int overlap = 0;       // shard chunks reduced with MPI_Iallreduce while the next is assigned, 0 blocks
+    unsigned int n_init = 1;        // independent restarts, the one with the lowest inertia is kept
+    std::string checkpoint;         // file in the outputs directory for the iteration state, empty for none
+    int checkpoint_every = 10;      // iterations between two checkpoints
+    bool resume = false;            // continue from the checkpoint instead of seeding
+    int balance = 0;                // iterations between moving points to the faster ranks, 0 keeps the loaded split
+    int incremental = 0;            // iterations between full sums when only changed points update them, 0 sums all
+    std::string order = "none";     // "morton" or "hilbert" sort the rows along a space-filling curve before the run
+    int sort_every = 0;             // iterations between grouping the rows by cluster, 0 keeps their order
+    const size_t *positions = NULL; // where --order moved every loaded row, so seeding and batches draw as if unsorted
+    MPI_Comm comm = MPI_COMM_WORLD; // ranks sharing a distributed run, a sub-communicator per concurrent restart
+};
+
+// What the last iteration of a run looked like
+struct KMeansSummary {
+    int iterations = 0;
+    bool converged = false;
+    long long changed = 0;
+    double inertia = 0;
+    double shift = 0;
+    long long distance_evaluations = 0;  // point to centroid distances over the whole run
+    unsigned int restart = 0;            // which of the --n-init restarts this is
+    double wait_fraction = -1;           // share of the iterations ranks spent in the reduction, -1 when not measured
+    double max_wait_fraction = -1;       // same for the rank that waited the most
+    int rebalances = 0;                  // times --balance moved points between ranks
+};
+
+// Splits the points of a distributed run by the measured throughput of the ranks. All points are numbered in
+// rank order and every rank works on one contiguous range of them; every <every> iterations the ranges are
+// moved towards the ranks that assign the most points per second, rows and labels travelling with them.
+class LoadBalancer {
+public:
+    LoadBalancer(const DataFrame &data, unsigned int *point_clusters, unsigned int dimension, int every, MPI_Comm comm);
+
+    // The rows this rank works on and their labels, the loaded shard while nothing moved
+    const DataFrame &rows() const;
+    unsigned int *labels();
+
+    void record(double assign_seconds, double wait_seconds, double iteration_seconds);
+
+    // Collective, returns whether the ranges moved
+    bool rebalance(int iteration);
+
+    // Collective, hands the labels back to the ranks that loaded the points and fills in the waiting time
+    void finish(KMeansSummary &summary);
+
+private:
+    const DataFrame &data;
+    unsigned int *point_clusters;
+    unsigned int dimension;
+    int every;
+    MPI_Comm comm;
+    int ranks, rank;
+    std::vector<long long> loaded, current;   // first point of every rank, and one past the last
+    DataFrame working;
+    std::vector<unsigned int> working_labels;
+    double assign_time = 0, wait_time = 0, loop_time = 0;
+    int moves = 0;
+};
+
+// Keeps the rows of a run grouped by their current cluster: every <every> iterations a stable counting sort
+// moves the rows and their labels so the points of one cluster are swept one after the other. Until the first
+// sort the loaded rows and <point_clusters> are used in place, finish() puts the labels back in their order.
+class ClusterSort {
+public:
+    ClusterSort(const DataFrame &data, unsigned int *point_clusters, unsigned int k, int every, int first_iteration);
+
+    const DataFrame &rows() const { return sorted? working: data; }
+    unsigned int *labels() { return sorted? working_labels.data(): point_clusters; }
+
+    // Sorts once <iteration> is due, the labels of the previous iteration decide the order
+    void sort(int iteration, bool parallel);
+    void finish(bool parallel);
+
+private:
+    const DataFrame &data;
+    unsigned int *point_clusters;
+    unsigned int k;
+    int every;
+    int first_iteration;
+    bool sorted = false;
+    DataFrame working;
+    std::vector<unsigned int> working_labels;
+    std::vector<size_t> order;      // row of <data> at every sorted position
+};
+
+typedef DataFrame (*KMeans)(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+
+int parse_points(char *cursor, const char *stop, std::vector<double> &values, unsigned int &dimension);
+bool holds_rows(const BinaryHeader &header, size_t file_size);
 int readfile(std::string filename, DataFrame &points);
-int writefile(std::string filename, DataFrame &points, unsigned int *point_clusters);
+int writefile(std::string filename, DataFrame &points, unsigned int *point_clusters, bool append = false);
+int readbinary(std::string filename, DataFrame &points);
+int writebinary(std::string filename, const DataFrame &points);
+int readshard(std::string filename, DataFrame &points, bool binary);
+int writeshard(std::string filename, DataFrame &points, unsigned int *point_clusters);
+int writeresult(std::string filename, const DataFrame &points, const unsigned int *point_clusters, const DataFrame &means);
+int writeresultshard(std::string filename, const DataFrame &points, const unsigned int *point_clusters, const DataFrame &means);
 double calculate_time(const struct timespec &starttime, const struct timespec &endtime);
-void point_sum(Point *in_point, Point *in_out_point, int *length, MPI_Datatype *dtype);
-long double square(double value);
-long double squared_euclidean_distance(const Point &first, const Point &second);
-DataFrame kmeansSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters);
-DataFrame kmeansOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters);
-DataFrame kmeansMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters);
-DataFrame kmeansHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters);
+double square(double value);
+double squared_euclidean_distance(const double *first, const double *second, unsigned int dimension);
+double squared_euclidean_distance(const float *first, const double *second, unsigned int dimension);
+NearestCentroid select_nearest_centroid(unsigned int dimension, bool single = false);
+int select_kernel(const std::string &name);
+const char *kernel_name();
+void initialize_means(const DataFrame &data, unsigned int k, unsigned int dimension, double *means,
+                      const KMeansOptions &options, bool distributed, bool parallel);
+bool should_stop(const KMeansOptions &options, KMeansSummary &summary, long long changed, double inertia, double shift);
+double update_means(double *means, const double *sums, const double *counts, unsigned int k, unsigned int dimension, bool parallel);
+DataFrame kmeansSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansElkanSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansElkanOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansElkanMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansElkanHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansHamerlySerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansHamerlyOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansHamerlyMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansHamerlyHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansYinyangSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansYinyangOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansYinyangMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansYinyangHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansMiniBatchSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansMiniBatchOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansMiniBatchMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansMiniBatchHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansKdTreeSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansKdTreeOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansKdTreeMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+DataFrame kmeansKdTreeHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+KMeans find_engine(const std::string &algorithm, const std::string &command);
+int kmeansStream(std::string filename, bool binary, unsigned int k, const KMeansOptions &options, KMeansSummary &summary,
+                 DataFrame &means, std::string output);
+DataFrame kmeansRestarts(const std::string &algorithm, const std::string &command, const DataFrame &data, unsigned int k,
+                         unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+std::vector<size_t> curve_order(const DataFrame &data, const std::string &curve, bool parallel);
+DataFrame permute_rows(const DataFrame &data, const std::vector<size_t> &order, bool parallel);
+void permute_labels(unsigned int *labels, const std::vector<size_t> &order);
 
 #endif
\ No newline at end of file
@@ -4,14 +4,38 @@
 #include <math.h>
 #include <getopt.h>
 #include <iostream>
+#include <random>
 #include <algorithm>
+#include <filesystem>
 #include "kmeans.h"
+#include "trace.h"
+#include "model.h"
+#include "numa.h"
 
 #define MASTER      0
-#define DataFrame   std::vector<Point>
+
+static void report(const std::string &command, double elapsed_time, const KMeansOptions &options, const KMeansSummary &summary,
+                   bool single_points) {
+    printf("Total elapsed time with \"%s\" command: %.6f secs\n", command.c_str(), elapsed_time);
+    if (summary.changed >= 0) {
+        printf("%s after %d iterations: %lld points changed, inertia %.6e, %lld distance evaluations\n",
+               summary.converged? "Converged": "Stopped", summary.iterations, summary.changed, summary.inertia, summary.distance_evaluations);
+    } else {
+        printf("%s after %d iterations: inertia %.6e, %lld distance evaluations\n",
+               summary.converged? "Converged": "Stopped", summary.iterations, summary.inertia, summary.distance_evaluations);
+    }
+    if (options.n_init > 1) {
+        printf("Best of %u restarts: restart %u (seed + %u)\n", options.n_init, summary.restart, summary.restart);
+    }
+    if (summary.wait_fraction >= 0) {
+        printf("Ranks waited %.1f%% of the iterations at the reduction on average, %.1f%% at most, %d rebalances\n",
+               100 * summary.wait_fraction, 100 * summary.max_wait_fraction, summary.rebalances);
+    }
+    printf("Assignment kernel: %s, %s precision, %s points\n", kernel_name(), options.precision.c_str(), single_points? "float32": "float64");
+}
 
 void usage(const char *progname) {
-    fprintf(stderr, "usage: %s [-h] [-c CLUSTERS] [-f FILENAME] [-t THREADS] [-n] [--] cmd\n", progname);
+    fprintf(stderr, "usage: %s [-h] [-c CLUSTERS] [-f FILENAME] [-t THREADS] [-F FORMAT] [-i ITERATIONS] [-I INIT] [-s SEED] [-a ALGORITHM] [-g GROUPS] [-K KERNEL] [--n-init RESTARTS] [--trace FILE] [--model FILE] [--checkpoint FILE] [--resume] [--numa] [-o OUTPUT] [-n] [--] cmd\n", progname);
     fprintf(stderr, "\n");
     fprintf(stderr, "optional arguments:\n");
     fprintf(stderr, "  -h --help                  show this help message and exit\n");
@@ -19,9 +43,46 @@ void usage(const char *progname) {
     fprintf(stderr, "  -c --clusters <CLUSTERS>   classify the data into <CLUSTERS> groups\n");
     fprintf(stderr, "  -f --filename <FILENAME>   <FILENAME> in the inputs directory\n");
     fprintf(stderr, "  -t --threads  <THREADS>    specify the number of omp threads\n");
+    fprintf(stderr, "  -F --format   <FORMAT>     input format, \"text\" (default) or memory-mapped \"binary\"\n");
+    fprintf(stderr, "  -i --max-iter <ITERATIONS> stop after at most <ITERATIONS> iterations (default 100)\n");
+    fprintf(stderr, "  --tol         <TOL>        stop once no centroid moves more than <TOL> (default 0)\n");
+    fprintf(stderr, "  --min-changed <POINTS>     stop once at most <POINTS> points change cluster (default 0)\n");
+    fprintf(stderr, "  --inertia-tol <TOL>        stop once the inertia changes by at most <TOL> relatively (default 0)\n");
+    fprintf(stderr, "                             a negative threshold disables its stopping rule\n");
+    fprintf(stderr, "  -I --init     <INIT>       seeding, \"random\", \"kmeans++\" (default) or \"kmeans||\"\n");
+    fprintf(stderr, "                             \"mpi\" and \"hybrid\" seed kmeans++ with its distributed kmeans|| form\n");
+    fprintf(stderr, "  -s --seed     <SEED>       seed of the random number generator for reproducible runs\n");
+    fprintf(stderr, "  -a --algorithm <ALGORITHM> \"lloyd\" (default), or \"elkan\", \"hamerly\" and \"yinyang\" to prune distances with bounds\n");
+    fprintf(stderr, "                             \"minibatch\" updates the centroids from small random batches\n");
+    fprintf(stderr, "                             \"kdtree\" filters whole cells of a kd-tree, for 2-d and 3-d points\n");
+    fprintf(stderr, "  -g --groups   <GROUPS>     centroid groups of \"yinyang\" (default k / 10)\n");
+    fprintf(stderr, "  -K --kernel   <KERNEL>     assignment kernel, \"auto\" (default), \"scalar\", \"avx2\" or \"avx512\"\n");
+    fprintf(stderr, "  --precision   <PRECISION>  \"double\" (default) or \"float\" points and kernel arithmetic, \"convert\" writes float32\n");
+    fprintf(stderr, "  --balance     <ITERATIONS> \"mpi\" and \"hybrid\" move points to the faster ranks every <ITERATIONS> (default 0, off)\n");
+    fprintf(stderr, "  --incremental <ITERATIONS> only move the points that changed cluster between full sums every <ITERATIONS>\n");
+    fprintf(stderr, "                             for \"lloyd\", \"elkan\", \"hamerly\" and \"yinyang\" (default 0, off)\n");
+    fprintf(stderr, "  --order       <ORDER>      sweep the rows in \"none\" (default), \"morton\" or \"hilbert\" curve order\n");
+    fprintf(stderr, "  --sort-every  <ITERATIONS> \"lloyd\" groups the rows by cluster every <ITERATIONS> (default 0, off)\n");
+    fprintf(stderr, "  --numa                     place the rows and thread partials on the NUMA node of the threads sweeping them\n");
+    fprintf(stderr, "                             and report the thread affinity, for \"omp\" and \"hybrid\"\n");
+    fprintf(stderr, "  --overlap     <CHUNKS>     \"mpi\" and \"hybrid\" reduce <CHUNKS> pieces of the shard while assigning the next\n");
+    fprintf(stderr, "                             for \"lloyd\" (default 0, off)\n");
+    fprintf(stderr, "  --batch-size  <POINTS>     points drawn per iteration by \"minibatch\" (default 1024)\n");
+    fprintf(stderr, "  --no-final-assign          skip labelling every point after \"minibatch\", points never drawn keep cluster k\n");
+    fprintf(stderr, "  --chunk-size  <POINTS>     points held in memory at once by \"stream\" (default 65536)\n");
+    fprintf(stderr, "  --n-init      <RESTARTS>   run <RESTARTS> seedings side by side and keep the lowest inertia (default 1)\n");
+    fprintf(stderr, "  --trace       <FILE>       time every phase per iteration, rank and thread into outputs/<FILE> (Chrome trace)\n");
+    fprintf(stderr, "  --model       <FILE>       save the trained centroids into outputs/<FILE>, \"predict\" loads them from there\n");
+    fprintf(stderr, "  --checkpoint  <FILE>       save the iteration state into outputs/<FILE> in the background\n");
+    fprintf(stderr, "  --checkpoint-every <ITERATIONS> iterations between two checkpoints (default 10)\n");
+    fprintf(stderr, "  --resume                   continue from the --checkpoint instead of seeding, if there is one\n");
+    fprintf(stderr, "  -o --output-format <OUTPUT> result format, \"text\" (default) <FILENAME>.out or \"binary\" <FILENAME>.result\n");
     fprintf(stderr, "  -n --no-output             disable writing the final result to the outputs directory\n");
     fprintf(stderr, "  --                         sperate the arguments for kmeans and for the command\n");
     fprintf(stderr, "  cmd                        only \"serial\", \"omp\", \"mpi\", and \"hybrid\" are available\n");
+    fprintf(stderr, "                             \"convert\" turns a text <FILENAME> into <FILENAME stem>.bin\n");
+    fprintf(stderr, "                             \"stream\" runs lloyd out of core, <CHUNK> points at a time\n");
+    fprintf(stderr, "                             \"predict\" labels <FILENAME> with the centroids of --model, without training\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -31,21 +92,85 @@ int main(int argc, char *argv[]) {
         {"clusters"  , optional_argument, NULL, 'c'},
         {"filename"  , optional_argument, NULL, 'f'},
         {"threads"   , optional_argument, NULL, 't'},
+        {"format"    , required_argument, NULL, 'F'},
+        {"max-iter"  , required_argument, NULL, 'i'},
+        {"tol"       , required_argument, NULL, 'T'},
+        {"min-changed", required_argument, NULL, 'M'},
+        {"inertia-tol", required_argument, NULL, 'E'},
+        {"init"      , required_argument, NULL, 'I'},
+        {"seed"      , required_argument, NULL, 's'},
+        {"algorithm" , required_argument, NULL, 'a'},
+        {"groups"    , required_argument, NULL, 'g'},
+        {"kernel"    , required_argument, NULL, 'K'},
+        {"precision" , required_argument, NULL, 'P'},
+        {"overlap"   , required_argument, NULL, 'O'},
+        {"chunk-size", required_argument, NULL, 'S'},
+        {"batch-size", required_argument, NULL, 'B'},
+        {"no-final-assign", no_argument , NULL, 'A'},
+        {"n-init"    , required_argument, NULL, 'N'},
+        {"trace"     , required_argument, NULL, 'R'},
+        {"model"     , required_argument, NULL, 'm'},
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"checkpoint-every", required_argument, NULL, 'e'},
+        {"resume"    , no_argument      , NULL, 'r'},
+        {"output-format", required_argument, NULL, 'o'},
+        {"balance"   , required_argument, NULL, 'b'},
+        {"numa"      , no_argument      , NULL, 'u'},
+        {"incremental", required_argument, NULL, 'D'},
+        {"order"     , required_argument, NULL, 'H'},
+        {"sort-every", required_argument, NULL, 'G'},
         {NULL        , 0                , NULL,  0 }
     };
 
     int opt;
     int threads = 4;
     bool output = true;
+    bool numa = false;
     std::string command;
     unsigned int clusters = 3;
+    std::string format = "text";
+    std::string output_format = "text";
+    std::string algorithm = "lloyd";
     std::string filename = "data.txt";
+    std::string kernel = "auto";
+    std::string trace;
+    std::string model_file;
+    KMeansOptions options;
+    KMeansSummary summary;
+    options.seed = std::random_device()();
 
-    while ((opt = getopt_long(argc, argv, "f:c:t:nh", long_options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "f:c:t:F:i:I:s:a:g:K:o:nh", long_options, NULL)) != EOF) {
         switch (opt) {
             case 'c': clusters = strtol(optarg, NULL, 10); break;
             case 'f': filename = std::string(optarg);      break;
             case 't': threads  = std::stoi(optarg);        break;
+            case 'F': format   = std::string(optarg);      break;
+            case 'o': output_format = std::string(optarg); break;
+            case 'i': options.max_iterations    = std::stoi(optarg); break;
+            case 'T': options.tolerance         = std::stod(optarg); break;
+            case 'M': options.min_changed       = std::stoll(optarg); break;
+            case 'E': options.inertia_tolerance = std::stod(optarg); break;
+            case 'I': options.init              = std::string(optarg); break;
+            case 's': options.seed              = std::stoull(optarg); break;
+            case 'a': algorithm = std::string(optarg); break;
+            case 'g': options.groups            = std::stoul(optarg); break;
+            case 'K': kernel = std::string(optarg);   break;
+            case 'P': options.precision         = std::string(optarg); break;
+            case 'O': options.overlap           = std::stoul(optarg); break;
+            case 'S': options.chunk_size        = std::stoull(optarg); break;
+            case 'B': options.batch_size        = std::stoll(optarg); break;
+            case 'A': options.final_assignment  = false; break;
+            case 'N': options.n_init            = std::stoul(optarg); break;
+            case 'R': trace = std::string(optarg);    break;
+            case 'm': model_file = std::string(optarg); break;
+            case 'C': options.checkpoint        = std::string(optarg); break;
+            case 'e': options.checkpoint_every  = std::stoi(optarg); break;
+            case 'r': options.resume            = true; break;
+            case 'b': options.balance           = std::stoi(optarg); break;
+            case 'u': numa = true;                         break;
+            case 'D': options.incremental       = std::stoi(optarg); break;
+            case 'H': options.order             = std::string(optarg); break;
+            case 'G': options.sort_every        = std::stoi(optarg); break;
             case 'n': output = false;                      break;
             case 'h': usage(argv[0]); exit(1);
             default : usage(argv[0]); exit(1);
@@ -57,24 +182,244 @@ int main(int argc, char *argv[]) {
     }
 
     int world_size, world_rank = 0;
-    DataFrame (*kmeans)(const DataFrame&, unsigned int, unsigned int*);
-
-    if (command == "serial") {
-        kmeans = &kmeansSerial;
-    } else if (command == "omp") {
-        kmeans = &kmeansOMP;
-    } else if (command == "mpi") {
-        kmeans = &kmeansMPI;
-    } else if (command == "hybrid") {
-        kmeans = &kmeansHybrid;
-    } else if (command == "") {
+    KMeans kmeans = NULL;
+
+    if (format != "text" && format != "binary") {
+        fprintf(stderr, "format \"%s\" is not available.\n", format.c_str());
+        exit(1);
+    }
+
+    if (output_format != "text" && output_format != "binary") {
+        fprintf(stderr, "output format \"%s\" is not available.\n", output_format.c_str());
+        exit(1);
+    }
+
+    if (options.init != "random" && options.init != "kmeans++" && options.init != "kmeans||") {
+        fprintf(stderr, "init \"%s\" is not available.\n", options.init.c_str());
+        exit(1);
+    }
+
+    if (select_kernel(kernel) == -1) {
+        fprintf(stderr, "kernel \"%s\" is not available on this machine.\n", kernel.c_str());
+        exit(1);
+    }
+
+    if (options.precision != "double" && options.precision != "float") {
+        fprintf(stderr, "precision \"%s\" is not available.\n", options.precision.c_str());
+        exit(1);
+    }
+
+    if (options.order != "none" && options.order != "morton" && options.order != "hilbert") {
+        fprintf(stderr, "order \"%s\" is not available.\n", options.order.c_str());
+        exit(1);
+    }
+
+    // Both move the rows of a shard around, the balancer between ranks and the sort within one
+    if (options.sort_every > 0 && options.balance > 0) {
+        fprintf(stderr, "--sort-every is not available with --balance.\n");
+        exit(1);
+    }
+
+    if (options.n_init == 0) {
+        fprintf(stderr, "at least one restart is needed.\n");
+        exit(1);
+    }
+
+    if (options.resume && options.checkpoint.empty()) {
+        fprintf(stderr, "--resume needs a --checkpoint to continue from.\n");
+        exit(1);
+    }
+
+    // Concurrent restarts would all write the same file
+    if (!options.checkpoint.empty() && options.n_init > 1) {
+        fprintf(stderr, "checkpoints are not available with restarts.\n");
+        exit(1);
+    }
+
+    if (command == "convert") {
+        DataFrame points;
+        if (readfile(filename, points) == -1) {
+            exit(1);
+        }
+
+        if (options.precision == "float") {
+            points.narrow();
+        }
+
+        std::string binary_filename = std::filesystem::path(filename).replace_extension(".bin").string();
+        if (writebinary(binary_filename, points) == -1) {
+            exit(1);
+        }
+
+        printf("Converted %zu %s points of dimension %u into inputs/%s\n", points.size(), points.single()? "float32": "float64",
+               points.dimension(), binary_filename.c_str());
+        return 0;
+    }
+
+    // Streaming never holds the whole input, so it bypasses the engines and writes labels as it goes
+    if (command == "stream") {
+        if (algorithm != "lloyd") {
+            fprintf(stderr, "algorithm \"%s\" is not available for the \"%s\" command.\n", algorithm.c_str(), command.c_str());
+            exit(1);
+        }
+
+        if (options.n_init > 1) {
+            fprintf(stderr, "restarts are not available for the \"%s\" command.\n", command.c_str());
+            exit(1);
+        }
+
+        if (!options.checkpoint.empty()) {
+            fprintf(stderr, "checkpoints are not available for the \"%s\" command.\n", command.c_str());
+            exit(1);
+        }
+
+        if (output_format != "text") {
+            fprintf(stderr, "output format \"%s\" is not available for the \"%s\" command.\n", output_format.c_str(), command.c_str());
+            exit(1);
+        }
+
+        // The chunks are swept once per iteration by a lloyd loop of its own, none of the engine options reach it
+        const char *engine_option = (options.balance > 0)? "--balance": (options.sort_every > 0)? "--sort-every":
+                                    (options.order != "none")? "--order": (options.incremental > 0)? "--incremental":
+                                    (options.overlap > 0)? "--overlap": numa? "--numa": NULL;
+        if (engine_option != NULL) {
+            fprintf(stderr, "%s is not available for the \"%s\" command.\n", engine_option, command.c_str());
+            exit(1);
+        }
+
+        threads = std::min(threads, omp_get_max_threads());
+        omp_set_num_threads(threads);
+
+        double elapsed_time;
+        struct timespec starttime, endtime;
+        DataFrame means;
+
+        if (!trace.empty()) {
+            trace_start(false);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+        if (kmeansStream(filename, format == "binary", clusters, options, summary, means, output? filename + ".out": "") == -1) {
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &endtime);
+        elapsed_time = calculate_time(starttime, endtime);
+
+        report(command, elapsed_time, options, summary, false);
+        if (!trace.empty() && trace_finish(trace, false) == -1) {
+            exit(1);
+        }
+        return 0;
+    }
+
+    // Prediction only needs the saved centroids, the points are labelled by the OpenMP threads
+    if (command == "predict") {
+        if (model_file.empty()) {
+            fprintf(stderr, "the \"%s\" command needs a --model.\n", command.c_str());
+            exit(1);
+        }
+
+        threads = std::min(threads, omp_get_max_threads());
+        omp_set_num_threads(threads);
+
+        KMeansModel model;
+        DataFrame points;
+        if (KMeansModel::load(model_file, model, options.precision == "float") == -1) {
+            exit(1);
+        }
+
+        if (((format == "binary")? readbinary(filename, points): readfile(filename, points)) == -1) {
+            exit(1);
+        }
+
+        if (options.precision == "float") {
+            points.narrow();
+        }
+
+        double elapsed_time;
+        struct timespec starttime, endtime;
+        std::vector<unsigned int> point_clusters(points.size());
+
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+        const double inertia = model.predict(points, point_clusters.data());
+        clock_gettime(CLOCK_MONOTONIC, &endtime);
+        elapsed_time = calculate_time(starttime, endtime);
+
+        if (inertia < 0) {
+            fprintf(stderr, "points of dimension %u do not fit a model of dimension %u.\n", points.dimension(), model.dimension());
+            exit(1);
+        }
+
+        printf("Total elapsed time with \"%s\" command: %.6f secs\n", command.c_str(), elapsed_time);
+        printf("Labelled %zu points with %u centroids: inertia %.6e\n", points.size(), model.k(), inertia);
+
+        if (output) {
+            int status;
+            if (output_format == "binary") {
+                status = writeresult(filename + ".result", points, point_clusters.data(), model.centroids());
+            } else {
+                status = writefile(filename + ".out", points, point_clusters.data());
+            }
+
+            if (status == -1) {
+                exit(1);
+            }
+        }
+        return 0;
+    }
+
+    if (command == "") {
         fprintf(stderr, "no command given.\n");
         exit(1);
-    } else {
+    } else if (command != "serial" && command != "omp" && command != "mpi" && command != "hybrid") {
         fprintf(stderr, "command \"%s\" is not available.\n", command.c_str());
         exit(1);
     }
 
+    kmeans = find_engine(algorithm, command);
+
+    if (kmeans == NULL) {
+        fprintf(stderr, "algorithm \"%s\" is not available for the \"%s\" command.\n", algorithm.c_str(), command.c_str());
+        exit(1);
+    }
+
+    // The pruned algorithms and kdtree compute in double whatever the points are stored as
+    if (options.precision == "float" && algorithm != "lloyd" && algorithm != "minibatch") {
+        fprintf(stderr, "precision \"float\" is not available for the \"%s\" algorithm.\n", algorithm.c_str());
+        exit(1);
+    }
+
+    // Only the lloyd engines time their sweeps and move points between ranks
+    if (options.balance > 0 && algorithm != "lloyd") {
+        fprintf(stderr, "--balance is not available for the \"%s\" algorithm.\n", algorithm.c_str());
+        exit(1);
+    }
+
+    // Only the lloyd engines regroup their rows by cluster
+    if (options.sort_every > 0 && algorithm != "lloyd") {
+        fprintf(stderr, "--sort-every is not available for the \"%s\" algorithm.\n", algorithm.c_str());
+        exit(1);
+    }
+
+    // Placement follows the OpenMP threads, a single-threaded process has nothing to spread
+    if (numa && command != "omp" && command != "hybrid") {
+        fprintf(stderr, "--numa is not available for the \"%s\" command.\n", command.c_str());
+        exit(1);
+    }
+
+    // Only the distributed lloyd sweep reduces its chunks while assigning the next
+    if (options.overlap > 0 && (algorithm != "lloyd" || (command != "mpi" && command != "hybrid"))) {
+        fprintf(stderr, "--overlap is not available for the \"%s\" algorithm with the \"%s\" command.\n", algorithm.c_str(),
+                command.c_str());
+        exit(1);
+    }
+
+    // kdtree sums whole cells and minibatch only sums its batch, neither keeps running totals
+    if (options.incremental > 0 && (algorithm == "kdtree" || algorithm == "minibatch")) {
+        fprintf(stderr, "--incremental is not available for the \"%s\" algorithm.\n", algorithm.c_str());
+        exit(1);
+    }
+
     if (command == "mpi") {
         MPI_Init(NULL, NULL);
         MPI_Comm_size(MPI_COMM_WORLD, &world_size);
@@ -93,23 +438,54 @@ int main(int argc, char *argv[]) {
         omp_set_num_threads(threads);
     }
 
+    // Distributed commands only load the shard they work on
+    int status;
     DataFrame points;
-    if (readfile(filename, points) == -1) {
+    if (command == "mpi" || command == "hybrid") {
+        status = readshard(filename, points, format == "binary");
+    } else {
+        status = (format == "binary")? readbinary(filename, points): readfile(filename, points);
+    }
+
+    if (status == -1) {
         if (command == "mpi" || command == "hybrid") {
             MPI_Finalize();
         }
         exit(1);
     }
 
+    // Lloyd and mini-batch sweep float32 points with --precision float, halving the bytes per point. The
+    // other algorithms need float64 points, so they (and --precision double) widen float32 files.
+    if (options.precision == "float") {
+        points.narrow();
+    } else {
+        points.widen();
+    }
+
+    // First touch by the sweeping threads, once the rows have their final precision
+    if (numa) {
+        numa_start();
+        points.place();
+        if (world_rank == MASTER) {
+            numa_report(points);
+        }
+    }
+
     double elapsed_time;
     struct timespec starttime, endtime;
     unsigned int *point_clusters = (unsigned int*) calloc(points.size(), sizeof(unsigned int));
 
+    const bool distributed = (command == "mpi" || command == "hybrid");
+    if (!trace.empty()) {
+        trace_start(distributed);
+    }
+
     if (world_rank == MASTER) {
         clock_gettime(CLOCK_MONOTONIC, &starttime);
     }
 
-    kmeans(points, clusters, point_clusters);
+    KMeansModel model;
+    model.fit(algorithm, command, points, clusters, point_clusters, options, summary);
 
     if (world_rank == MASTER) {
         clock_gettime(CLOCK_MONOTONIC, &endtime);
@@ -117,14 +493,48 @@ int main(int argc, char *argv[]) {
     }
 
     if (world_rank == MASTER) {
-        printf("Total elapsed time with \"%s\" command: %.6f secs\n", command.c_str(), elapsed_time);
-        if (output) {
-            if (writefile(filename + ".out", points, point_clusters) == -1) {
-                if (command == "mpi" || command == "hybrid") {
-                    MPI_Finalize();
-                }
-                exit(1);
+        report(command, elapsed_time, options, summary, points.single());
+    }
+
+    if (!trace.empty() && trace_finish(trace, distributed) == -1) {
+        if (distributed) {
+            MPI_Finalize();
+        }
+        exit(1);
+    }
+
+    if (!model_file.empty() && world_rank == MASTER && model.save(model_file) == -1) {
+        status = -1;
+    }
+
+    if (distributed) {
+        MPI_Bcast(&status, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+    }
+
+    if (status == -1) {
+        if (distributed) {
+            MPI_Finalize();
+        }
+        exit(1);
+    }
+
+    // Distributed commands write every shard at its own offset with one collective MPI-IO call
+    if (output) {
+        if (distributed && output_format == "binary") {
+            status = writeresultshard(filename + ".result", points, point_clusters, model.centroids());
+        } else if (distributed) {
+            status = writeshard(filename + ".out", points, point_clusters);
+        } else if (output_format == "binary") {
+            status = writeresult(filename + ".result", points, point_clusters, model.centroids());
+        } else {
+            status = writefile(filename + ".out", points, point_clusters);
+        }
+
+        if (status == -1) {
+            if (command == "mpi" || command == "hybrid") {
+                MPI_Finalize();
             }
+            exit(1);
         }
     }
 
@@ -0,0 +1,215 @@
+#include <omp.h>
+#include <mpi.h>
+#include <math.h>
+#include <random>
+#include <algorithm>
+#include "kmeans.h"
+#include "trace.h"
+#include "checkpoint.h"
+
+#define MASTER      0
+
+// Mini-batch k-means (Sculley 2010). Every iteration draws a small batch from each shard, assigns it and moves
+// every centroid towards the mean of its batch points with a learning rate of 1 / points it has absorbed so far.
+// The batch sums and counts are packed like the Lloyd totals, so the distributed variants reduce them in one call.
+template <typename P>
+static DataFrame kmeansMiniBatch(const DataFrame &data, unsigned int k, unsigned int *point_clusters,
+                                 const KMeansOptions &options, KMeansSummary &summary, bool distributed, bool parallel) {
+    int world_rank = MASTER;
+    unsigned int dimension = data.dimension();
+    unsigned long long seed = options.seed;
+    if (distributed) {
+        MPI_Comm_rank(options.comm, &world_rank);
+        MPI_Allreduce(MPI_IN_PLACE, &dimension, 1, MPI_UNSIGNED, MPI_MAX, options.comm);
+        MPI_Bcast(&seed, 1, MPI_UNSIGNED_LONG_LONG, MASTER, options.comm);
+    }
+
+    const bool single = (options.precision == "float");
+    const Nearest<P> nearest = select_nearest<P>(dimension, single);
+    Centroids centroids;
+    summary = KMeansSummary();
+    const int values = k * dimension;
+
+    DataFrame means(k, dimension);
+
+    // Each shard draws its share of the batch, so the batch is spread evenly over the whole dataset
+    const long long points = data.size();
+    const long long batch_size = (data.total() > 0)? llround((double) options.batch_size * points / data.total()): 0;
+    std::seed_seq batch_seed{ seed, (unsigned long long) world_rank, 1ULL };
+    std::mt19937_64 rng(batch_seed);
+    std::uniform_int_distribution<long long> uniform(0, std::max(0LL, points - 1));
+
+    std::vector<long long> batch(batch_size);
+    std::vector<unsigned int> batch_clusters(batch_size);
+    std::vector<double> seen(k, 0);
+
+    // Seed the centroids with the chosen initializer, unless a checkpoint has them with the learning rates
+    // and the batch generator of every rank
+    Checkpoint checkpoint(options, k, dimension, distributed);
+    int first_iteration = checkpoint.resume(means.data(), summary, &seen, &rng);
+    if (first_iteration < 0) {
+        TraceSpan span(TRACE_SEED);
+        initialize_means(data, k, dimension, means.data(), options, distributed, parallel);
+        first_iteration = 0;
+    }
+
+    Accumulators accumulators(parallel? omp_get_max_threads(): 1, k, dimension);
+    const int size = accumulators.size();
+    std::vector<double> totals(size);
+    const double *counts = &totals[values];
+
+    // Points never drawn are left in the out-of-range cluster k. The labels are not checkpointed, so a resumed
+    // run starts from here as well and should_stop() leaves its first iteration out of the changed-points rule.
+    std::fill_n(point_clusters, points, k);
+
+    for (int iteration = first_iteration; iteration < options.max_iterations; iteration++) {
+        // Lay the current centroids out for the assignment kernel
+        trace_iteration(iteration);
+        centroids.pack(means.data(), k, dimension, single);
+
+        // Draw loaded rows, so --order moves where the batch is read but not which points it holds
+        for (long long i = 0; i < batch_size; i++) {
+            const long long draw = uniform(rng);
+            batch[i] = (options.positions != NULL)? (long long) options.positions[draw]: draw;
+        }
+
+        #pragma omp parallel if(parallel)
+        {
+            const int thread_id = omp_get_thread_num();
+            double *sums = accumulators.sums(thread_id);
+            double *local_counts = accumulators.counts(thread_id);
+            double inertia = 0;
+            accumulators.clear(thread_id);
+
+            // Find the batch point belongs to which cluster and sum it up in the same sweep
+            {
+                TraceSpan span(TRACE_ASSIGN);
+                #pragma omp for nowait
+                for (long long i = 0; i < batch_size; i++) {
+                    double distance;
+                    const P *row = data.row<P>(batch[i]);
+                    const unsigned int cluster = nearest(row, centroids, &distance);
+                    batch_clusters[i] = cluster;
+                    inertia += distance;
+
+                    for (unsigned int d = 0; d < dimension; d++) {
+                        sums[cluster * dimension + d] += row[d];
+                    }
+                    local_counts[cluster] += 1;
+                }
+            }
+
+            local_counts[k + TOTAL_INERTIA] = inertia;
+
+            TraceSpan span(TRACE_REDUCE);
+            accumulators.reduce(thread_id, omp_get_num_threads());
+        }
+
+        // A point can be drawn twice in one batch, so the labels are written back serially
+        double changed = 0;
+        for (long long i = 0; i < batch_size; i++) {
+            if (point_clusters[batch[i]] != batch_clusters[i]) {
+                point_clusters[batch[i]] = batch_clusters[i];
+                changed += 1;
+            }
+        }
+        accumulators.counts(0)[k + TOTAL_CHANGED] = changed;
+
+        std::copy_n(accumulators.sums(0), size, totals.begin());
+        if (distributed) {
+            TraceSpan span(TRACE_COMMUNICATE);
+            MPI_Allreduce(MPI_IN_PLACE, totals.data(), size, MPI_DOUBLE, MPI_SUM, options.comm);
+        }
+
+        // The per-point step c += (x - c) / seen applied to the n batch points of a centroid at once
+        TraceSpan update_span(TRACE_UPDATE);
+        double shift = 0, drawn = 0;
+        for (unsigned int cluster = 0; cluster < k; cluster++) {
+            drawn += counts[cluster];
+            if (counts[cluster] == 0) {
+                continue;
+            }
+
+            seen[cluster] += counts[cluster];
+            double moved = 0;
+            for (unsigned int d = 0; d < dimension; d++) {
+                double &mean = means[cluster][d];
+                const double value = mean + (totals[cluster * dimension + d] - counts[cluster] * mean) / seen[cluster];
+                moved += square(value - mean);
+                mean = value;
+            }
+            shift = std::max(shift, sqrt(moved));
+        }
+
+        summary.distance_evaluations += (long long) drawn * k;
+        trace_count(TRACE_CHANGED, counts[k + TOTAL_CHANGED]);
+        trace_count(TRACE_INERTIA, counts[k + TOTAL_INERTIA]);
+        trace_count(TRACE_SHIFT, shift);
+
+        // The changed points and the inertia only cover the batch, so they are noisy stopping signals
+        if (should_stop(options, summary, counts[k + TOTAL_CHANGED], counts[k + TOTAL_INERTIA], shift)) {
+            break;
+        }
+        checkpoint.save(iteration + 1, means.data(), summary, &seen, &rng);
+    }
+
+    if (!options.final_assignment) {
+        return means;
+    }
+
+    // Label every point with the final centroids, which also gives the exact inertia
+    centroids.pack(means.data(), k, dimension, single);
+    double final_totals[2] = { 0, 0 };
+    double changed = 0, inertia = 0;
+
+    #pragma omp parallel for reduction(+:changed, inertia) if(parallel)
+    for (long long point = 0; point < points; point++) {
+        double distance;
+        const unsigned int cluster = nearest(data.row<P>(point), centroids, &distance);
+        if (cluster != point_clusters[point]) {
+            changed += 1;
+        }
+        point_clusters[point] = cluster;
+        inertia += distance;
+    }
+
+    final_totals[TOTAL_CHANGED] = changed;
+    final_totals[TOTAL_INERTIA] = inertia;
+    if (distributed) {
+        MPI_Allreduce(MPI_IN_PLACE, final_totals, 2, MPI_DOUBLE, MPI_SUM, options.comm);
+    }
+
+    summary.changed = final_totals[TOTAL_CHANGED];
+    summary.inertia = final_totals[TOTAL_INERTIA];
+    summary.distance_evaluations += (long long) data.total() * k;
+
+    return means;
+}
+
+DataFrame kmeansMiniBatchSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (data.single()) {
+        return kmeansMiniBatch<float>(data, k, point_clusters, options, summary, false, false);
+    }
+    return kmeansMiniBatch<double>(data, k, point_clusters, options, summary, false, false);
+}
+
+DataFrame kmeansMiniBatchOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (data.single()) {
+        return kmeansMiniBatch<float>(data, k, point_clusters, options, summary, false, true);
+    }
+    return kmeansMiniBatch<double>(data, k, point_clusters, options, summary, false, true);
+}
+
+DataFrame kmeansMiniBatchMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (data.single()) {
+        return kmeansMiniBatch<float>(data, k, point_clusters, options, summary, true, false);
+    }
+    return kmeansMiniBatch<double>(data, k, point_clusters, options, summary, true, false);
+}
+
+DataFrame kmeansMiniBatchHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (data.single()) {
+        return kmeansMiniBatch<float>(data, k, point_clusters, options, summary, true, true);
+    }
+    return kmeansMiniBatch<double>(data, k, point_clusters, options, summary, true, true);
+}
@@ -0,0 +1,159 @@
+#include <omp.h>
+#include <mpi.h>
+#include <fstream>
+#include <filesystem>
+#include <string.h>
+#include <sys/stat.h>
+#include "model.h"
+
+#define MODE            0775
+#define PREDICT_GRAIN   4096    // rows below which a batch is labelled by the calling thread
+
+KMeansModel::KMeansModel(DataFrame centroids, bool single) : means(std::move(centroids)), single(single) {
+    prepare();
+}
+
+void KMeansModel::prepare() {
+    means.widen();
+    packed.pack(means.data(), k(), dimension(), single);
+    single_packed.pack(means.data(), k(), dimension(), true);
+    nearest = select_nearest<double>(dimension(), single);
+    single_nearest = select_nearest<float>(dimension(), true);
+}
+
+int KMeansModel::fit(const std::string &algorithm, const std::string &command, DataFrame &data, unsigned int k,
+                     unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    const KMeans kmeans = find_engine(algorithm, command);
+    if (kmeans == NULL) {
+        return -1;
+    }
+
+    // Every rank sorts its own shard in place, the shard keeps its place in the dataset
+    if (options.order != "none") {
+        const bool parallel = (command == "omp" || command == "hybrid");
+        const std::vector<size_t> order = curve_order(data, options.order, parallel);
+        std::vector<size_t> positions(order.size());
+        for (size_t row = 0; row < order.size(); row++) {
+            positions[order[row]] = row;
+        }
+
+        KMeansOptions sorted = options;
+        sorted.order = "none";
+        sorted.positions = positions.data();
+
+        data.permute(order);
+        const int status = fit(algorithm, command, data, k, point_clusters, sorted, summary);
+        data.permute(positions);
+        permute_labels(point_clusters, positions);
+        return status;
+    }
+
+    if (options.n_init > 1) {
+        means = kmeansRestarts(algorithm, command, data, k, point_clusters, options, summary);
+    } else {
+        means = kmeans(data, k, point_clusters, options, summary);
+    }
+
+    single = (options.precision == "float");
+    prepare();
+
+    return 0;
+}
+
+// Same sweep as the engines without the sums, every thread only writes its own labels
+template <typename P>
+static double label_rows(const DataFrame &batch, unsigned int *labels, Nearest<P> nearest, const Centroids &centroids, bool parallel) {
+    const long long rows = batch.size();
+    double inertia = 0;
+
+    #pragma omp parallel for reduction(+:inertia) if(parallel && rows > PREDICT_GRAIN)
+    for (long long i = 0; i < rows; i++) {
+        double distance;
+        labels[i] = nearest(batch.row<P>(i), centroids, &distance);
+        inertia += distance;
+    }
+
+    return inertia;
+}
+
+double KMeansModel::predict(const DataFrame &batch, unsigned int *labels, bool parallel) const {
+    if (batch.size() > 0 && batch.dimension() != dimension()) {
+        return -1;
+    }
+
+    if (batch.single()) {
+        return label_rows<float>(batch, labels, single_nearest, single_packed, parallel);
+    }
+    return label_rows<double>(batch, labels, nearest, packed, parallel);
+}
+
+int KMeansModel::save(std::string filename) const {
+    std::filesystem::path dir("outputs");
+    std::filesystem::path file(filename);
+    std::filesystem::path pathname = dir / file;
+
+    if (!std::filesystem::exists(dir)) {
+        mkdir(dir.c_str(), MODE);
+    }
+
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.dtype = DTYPE_FLOAT64;
+    header.count = k();
+    header.dimension = dimension();
+
+    std::ofstream fp;
+    fp.open(pathname, std::ofstream::out | std::ofstream::binary);
+
+    if (fp.is_open()) {
+        fp.write((const char*) &header, sizeof(header));
+        fp.write((const char*) means.data(), (size_t) k() * dimension() * sizeof(double));
+        fp.close();
+    } else {
+        perror("save model error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int KMeansModel::load(std::string filename, KMeansModel &model, bool single) {
+    std::filesystem::path dir("outputs");
+    std::filesystem::path file(filename);
+    std::filesystem::path pathname = dir / file;
+
+    std::ifstream fp;
+    fp.open(pathname, std::ifstream::in | std::ifstream::binary);
+
+    if (!fp.is_open()) {
+        perror("load model error");
+        return -1;
+    }
+
+    BinaryHeader header;
+    if (!fp.read((char*) &header, sizeof(header)) || memcmp(header.magic, MODEL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MODEL_VERSION || header.dtype != DTYPE_FLOAT64 || header.dimension == 0 || header.count == 0) {
+        fprintf(stderr, "load model error: %s is not a version %d model file\n", pathname.c_str(), MODEL_VERSION);
+        return -1;
+    }
+
+    // The header is laid out like a point file, so the centroids it promises are checked before they are allocated
+    std::error_code error;
+    const uintmax_t file_size = std::filesystem::file_size(pathname, error);
+    if (error || !holds_rows(header, file_size)) {
+        fprintf(stderr, "load model error: %s is truncated\n", pathname.c_str());
+        return -1;
+    }
+
+    DataFrame centroids(header.count, header.dimension);
+    if (!fp.read((char*) centroids.data(), header.count * header.dimension * sizeof(double))) {
+        fprintf(stderr, "load model error: %s is truncated\n", pathname.c_str());
+        return -1;
+    }
+
+    model = KMeansModel(std::move(centroids), single);
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef __MODEL_H__
+#define __MODEL_H__
+
+#include <string>
+#include "kmeans.h"
+
+#define MODEL_MAGIC     "KMMODEL\0"
+#define MODEL_VERSION   1
+
+// Trained centroids, ready to label new points. The centroids are packed for the assignment kernel once,
+// so predict() only reads shared state and may be called from any number of threads at the same time.
+class KMeansModel {
+public:
+    KMeansModel() {}
+    KMeansModel(DataFrame centroids, bool single = false);
+
+    // Train with <algorithm> on <command>'s engine, options.n_init > 1 keeps the best restart. With options.order
+    // the rows of <data> are sorted along that curve in place for the run and put back afterwards, so the labels
+    // follow the order of <data> and the seeding draws the same rows as without it.
+    int fit(const std::string &algorithm, const std::string &command, DataFrame &data, unsigned int k,
+            unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary);
+
+    // Label every row of <batch> with its closest centroid, returns the inertia of the batch or -1 when
+    // the dimension does not match. Small batches stay on the calling thread for latency.
+    double predict(const DataFrame &batch, unsigned int *labels, bool parallel = true) const;
+
+    // A BinaryHeader with MODEL_MAGIC, followed by k * dimension float64 values, in the outputs directory
+    int save(std::string filename) const;
+    static int load(std::string filename, KMeansModel &model, bool single = false);
+
+    unsigned int k() const { return means.size(); }
+    unsigned int dimension() const { return means.dimension(); }
+    const DataFrame &centroids() const { return means; }
+
+private:
+    void prepare();
+
+    DataFrame means;
+    bool single = false;
+    Centroids packed;           // arithmetic of <single>, for float64 rows
+    Centroids single_packed;    // float32 rows always use float arithmetic
+    Nearest<double> nearest = NULL;
+    Nearest<float> single_nearest = NULL;
+};
+
+#endif
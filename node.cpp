@@ -0,0 +1,83 @@
+#include <mpi.h>
+#include <algorithm>
+#include "kmeans.h"
+
+#define LEADER      0
+
+NodeReduction::NodeReduction(MPI_Comm comm, size_t length) : comm(comm), length(length) {
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_size(node_comm, &node_size);
+
+    // The window only pays off once some node holds several ranks. All ranks must take the same path, since a
+    // lone rank still meets the other leaders in leader_comm, so the choice is made over the whole communicator.
+    int largest = node_size;
+    MPI_Allreduce(&node_size, &largest, 1, MPI_INT, MPI_MAX, comm);
+    if (largest == 1) {
+        MPI_Comm_free(&node_comm);
+        node_comm = MPI_COMM_NULL;
+        return;
+    }
+
+    MPI_Comm_split(comm, (node_rank == LEADER)? 0: MPI_UNDEFINED, 0, &leader_comm);
+
+    // The leader holds one slot per rank and the node totals, the others map its segment
+    const MPI_Aint bytes = (node_rank == LEADER)? (node_size + 1) * length * sizeof(double): 0;
+    double *base;
+    MPI_Win_allocate_shared(bytes, sizeof(double), MPI_INFO_NULL, node_comm, &base, &window);
+
+    MPI_Aint size;
+    int unit;
+    MPI_Win_shared_query(window, LEADER, &size, &unit, &slots);
+    totals = slots + node_size * length;
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+}
+
+NodeReduction::~NodeReduction() {
+    if (window != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(window);
+        MPI_Win_free(&window);
+    }
+    if (leader_comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&leader_comm);
+    }
+    if (node_comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&node_comm);
+    }
+}
+
+// Every rank makes its stores visible and waits for the others of its node
+void NodeReduction::synchronize() {
+    MPI_Win_sync(window);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(window);
+}
+
+// Every node folds the slots of its ranks in shared memory, each rank summing a stripe of the values,
+// and only the leaders meet in MPI_Allreduce. The result is read back from the segment.
+void NodeReduction::allreduce(const double *values, double *result) {
+    if (node_comm == MPI_COMM_NULL) {
+        MPI_Allreduce(values, result, length, MPI_DOUBLE, MPI_SUM, comm);
+        return;
+    }
+
+    std::copy_n(values, length, slots + node_rank * length);
+    synchronize();
+
+    const size_t begin = length * node_rank / node_size, end = length * (node_rank + 1) / node_size;
+    for (size_t i = begin; i < end; i++) {
+        double sum = 0;
+        for (int rank = 0; rank < node_size; rank++) {
+            sum += slots[rank * length + i];
+        }
+        totals[i] = sum;
+    }
+    synchronize();
+
+    if (leader_comm != MPI_COMM_NULL) {
+        MPI_Allreduce(MPI_IN_PLACE, totals, length, MPI_DOUBLE, MPI_SUM, leader_comm);
+    }
+    synchronize();
+
+    std::copy_n(totals, length, result);
+}
@@ -0,0 +1,205 @@
+#include <omp.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <string>
+#include "numa.h"
+
+#define NODE_PATH       "/sys/devices/system/node/node"
+#define ONLINE_PATH     "/sys/devices/system/node/online"
+#define SAMPLES         64  // pages of every thread's rows asked about in the report
+
+bool numa_on = false;
+static int nodes = 1;                  // one past the largest node id, the length of per-node data
+static int present = 1;                // nodes actually present
+static std::vector<int> cpu_nodes;     // node of every cpu, cpus not listed belong to node 0
+
+// Expand a sysfs cpu or node list like "0-3,8-11"
+static std::vector<int> parse_cpulist(const std::string &list) {
+    std::vector<int> cpus;
+    size_t position = 0;
+    while (position < list.size()) {
+        size_t end = list.find(',', position);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+
+        const std::string range = list.substr(position, end - position);
+        const size_t dash = range.find('-');
+        const int first = atoi(range.c_str());
+        const int last = (dash == std::string::npos)? first: atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        position = end + 1;
+    }
+
+    return cpus;
+}
+
+int numa_start() {
+    cpu_nodes.clear();
+    nodes = 0;
+    present = 0;
+
+    // Node ids can have holes, e.g. "0,2" once a node is offlined, so the per-node data is indexed up to the largest
+    std::ifstream online(ONLINE_PATH);
+    std::string online_list;
+    if (online && std::getline(online, online_list)) {
+        for (int node : parse_cpulist(online_list)) {
+            std::ifstream file(NODE_PATH + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!file || !std::getline(file, list)) {
+                continue;
+            }
+
+            for (int cpu : parse_cpulist(list)) {
+                if (cpu >= (int) cpu_nodes.size()) {
+                    cpu_nodes.resize(cpu + 1, 0);
+                }
+                cpu_nodes[cpu] = node;
+            }
+            nodes = std::max(nodes, node + 1);
+            present += 1;
+        }
+    }
+
+    nodes = std::max(nodes, 1);
+    present = std::max(present, 1);
+    numa_on = true;
+    return nodes;
+}
+
+int numa_nodes() {
+    return nodes;
+}
+
+int numa_node() {
+    const int cpu = sched_getcpu();
+    return (cpu >= 0 && cpu < (int) cpu_nodes.size())? cpu_nodes[cpu]: 0;
+}
+
+// Fresh page-aligned rows, each written first by the thread that sweeps it under a static schedule
+template <typename T>
+static std::shared_ptr<void> first_touch(const T *source, size_t count, unsigned int dimension, T *&begin) {
+    const size_t bytes = std::max<size_t>(count * dimension * sizeof(T), 1);
+    begin = (T*) aligned_alloc(PAGE_SIZE, (bytes + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE);
+
+    T *target = begin;
+    #pragma omp parallel for schedule(static)
+    for (long long point = 0; point < (long long) count; point++) {
+        std::copy_n(source + point * dimension, dimension, target + point * dimension);
+    }
+
+    return std::shared_ptr<void>(begin, free);
+}
+
+// The copy is held like a mapped file, so the frame keeps its size, shard and precision
+void DataFrame::place() {
+    if (is_single) {
+        float *begin;
+        std::shared_ptr<void> region = first_touch(single_data(), count, dims, begin);
+        single_values = std::vector<float>();
+        map(region, begin, count, dims);
+    } else {
+        double *begin;
+        std::shared_ptr<void> region = first_touch(data(), count, dims, begin);
+        values = std::vector<double>();
+        map(region, begin, count, dims);
+    }
+}
+
+// Nodes of <count> pages, negative where move_pages cannot tell (a page never touched, or no NUMA support)
+static std::vector<int> page_nodes(std::vector<void*> &pages) {
+    std::vector<int> status(pages.size(), -1);
+    if (!pages.empty() && syscall(SYS_move_pages, 0, pages.size(), pages.data(), NULL, status.data(), 0) != 0) {
+        std::fill(status.begin(), status.end(), -1);
+    }
+    return status;
+}
+
+void numa_report(const DataFrame &points) {
+    const int threads = omp_get_max_threads();
+    std::vector<int> cpus(threads, -1);
+    std::vector<long long> firsts(threads, -1), lasts(threads, -1);
+
+    // The same static schedule as the sweeps, so every thread reports the rows it assigns
+    #pragma omp parallel
+    {
+        const int thread = omp_get_thread_num();
+        cpus[thread] = sched_getcpu();
+
+        #pragma omp for schedule(static)
+        for (long long point = 0; point < (long long) points.size(); point++) {
+            if (firsts[thread] < 0) {
+                firsts[thread] = point;
+            }
+            lasts[thread] = point;
+        }
+    }
+
+    const char *bytes = points.single()? (const char*) points.single_data(): (const char*) points.data();
+    const size_t row = points.dimension() * (points.single()? sizeof(float): sizeof(double));
+
+    const omp_proc_bind_t bind = omp_get_proc_bind();
+    printf("NUMA placement: %d nodes, %d threads%s\n", present, threads,
+           (bind == omp_proc_bind_false)? ", not bound (set OMP_PROC_BIND and OMP_PLACES to pin them)": "");
+
+    for (int thread = 0; thread < threads; thread++) {
+        const int node = (cpus[thread] >= 0 && cpus[thread] < (int) cpu_nodes.size())? cpu_nodes[cpus[thread]]: 0;
+        printf("  thread %3d: cpu %3d, node %d", thread, cpus[thread], node);
+
+        if (firsts[thread] < 0 || row == 0) {
+            printf(", no rows\n");
+            continue;
+        }
+
+        // Sample pages evenly over the thread's rows
+        const size_t first = firsts[thread] * row, last = (lasts[thread] + 1) * row - 1;
+        const size_t pages = (last / PAGE_SIZE) - (first / PAGE_SIZE) + 1;
+        const size_t samples = std::min<size_t>(pages, SAMPLES);
+        std::vector<void*> addresses(samples);
+        for (size_t sample = 0; sample < samples; sample++) {
+            const size_t page = first / PAGE_SIZE + sample * pages / samples;
+            addresses[sample] = (void*) (((uintptr_t) bytes + page * PAGE_SIZE) & ~(uintptr_t) (PAGE_SIZE - 1));
+        }
+
+        const std::vector<int> status = page_nodes(addresses);
+        int known = 0, local = 0;
+        for (int page_node : status) {
+            known += (page_node >= 0);
+            local += (page_node == node);
+        }
+
+        if (known == 0) {
+            printf(", rows %lld-%lld on unknown nodes\n", firsts[thread], lasts[thread]);
+        } else {
+            printf(", rows %lld-%lld, %.1f%% local\n", firsts[thread], lasts[thread], 100.0 * local / known);
+        }
+    }
+}
+
+CentroidReplicas::CentroidReplicas() : copies(numa_on? numa_nodes(): 0), stamps(copies.size(), -1) {}
+
+const Centroids &CentroidReplicas::local(const Centroids &centroids) {
+    if (copies.size() <= 1) {
+        return centroids;
+    }
+
+    const int node = numa_node();
+    #pragma omp critical(replicas)
+    {
+        if (stamps[node] != generation) {
+            copies[node] = centroids;
+            stamps[node] = generation;
+        }
+    }
+
+    #pragma omp barrier
+    return copies[node];
+}
@@ -0,0 +1,42 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <vector>
+#include "kmeans.h"
+
+#define PAGE_SIZE       4096
+
+// Set by numa_start, the engines then keep per-thread and per-node data on pages of their own
+extern bool numa_on;
+
+// Read the online NUMA nodes and their cpus from sysfs, a machine without them counts as one node. Returns one
+// past the largest node id, which numa_nodes() keeps as the length of per-node data.
+int numa_start();
+int numa_nodes();
+
+// Node of the cpu the calling thread runs on right now
+int numa_node();
+
+// Print where the OpenMP threads run and how many of the rows each one sweeps sit on its own node
+void numa_report(const DataFrame &points);
+
+// One copy of the packed centroids per NUMA node, so the threads of a sweep read them from local memory.
+// A copy is made by the first thread of its node that asks for it, which places its pages on that node.
+class CentroidReplicas {
+public:
+    CentroidReplicas();
+
+    // The centroids were packed again, the copies are stale
+    void refresh() { generation += 1; }
+
+    // Called by every thread of the team, returns the copy of the thread's node. With more than one node it
+    // ends in a barrier, so no thread reads a copy another one is still writing.
+    const Centroids &local(const Centroids &centroids);
+
+private:
+    std::vector<Centroids> copies;
+    std::vector<long long> stamps;
+    long long generation = 0;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include <omp.h>
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include "kmeans.h"
+#include "numa.h"
+
+#define KEY_BITS    64
+#define MAX_AXES    64  // a key needs at least one bit per axis, higher dimensions are sorted by their first 64
+
+// Skilling's transform of the coordinates into the transposed Hilbert index ("Programming the Hilbert curve",
+// AIP Conference Proceedings 707, 2004), reading its bits from the top of every axis in turn gives the index
+static void hilbert_transpose(uint32_t *x, unsigned int bits, unsigned int axes) {
+    const uint32_t top = 1u << (bits - 1);
+
+    // Inverse undo
+    for (uint32_t q = top; q > 1; q >>= 1) {
+        const uint32_t p = q - 1;
+        for (unsigned int axis = 0; axis < axes; axis++) {
+            if (x[axis] & q) {
+                x[0] ^= p;
+            } else {
+                const uint32_t t = (x[0] ^ x[axis]) & p;
+                x[0] ^= t;
+                x[axis] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    for (unsigned int axis = 1; axis < axes; axis++) {
+        x[axis] ^= x[axis - 1];
+    }
+    uint32_t t = 0;
+    for (uint32_t q = top; q > 1; q >>= 1) {
+        if (x[axes - 1] & q) {
+            t ^= q - 1;
+        }
+    }
+    for (unsigned int axis = 0; axis < axes; axis++) {
+        x[axis] ^= t;
+    }
+}
+
+// Bits of every axis interleaved from the top, the Morton key of untransformed coordinates
+static uint64_t interleave(const uint32_t *x, unsigned int bits, unsigned int axes) {
+    uint64_t key = 0;
+    for (int bit = bits - 1; bit >= 0; bit--) {
+        for (unsigned int axis = 0; axis < axes; axis++) {
+            key = (key << 1) | ((x[axis] >> bit) & 1);
+        }
+    }
+    return key;
+}
+
+// Rows of <data> in the order of their "morton" or "hilbert" key. Every axis is scaled onto the same grid
+// between its smallest and largest coordinate, and ties keep the rows in their loaded order.
+std::vector<size_t> curve_order(const DataFrame &data, const std::string &curve, bool parallel) {
+    const long long points = data.size();
+    std::vector<size_t> order(points);
+    for (long long point = 0; point < points; point++) {
+        order[point] = point;
+    }
+    if (points == 0 || data.dimension() == 0) {
+        return order;
+    }
+
+    const unsigned int axes = std::min(data.dimension(), (unsigned int) MAX_AXES);
+    const unsigned int bits = std::min(32u, KEY_BITS / axes);
+    const bool hilbert = (curve == "hilbert");
+
+    std::vector<double> lowest(axes, std::numeric_limits<double>::max()), highest(axes, std::numeric_limits<double>::lowest());
+    double *low = lowest.data(), *high = highest.data();
+    #pragma omp parallel for reduction(min:low[:axes]) reduction(max:high[:axes]) if(parallel)
+    for (long long point = 0; point < points; point++) {
+        for (unsigned int axis = 0; axis < axes; axis++) {
+            low[axis] = std::min(low[axis], data.at(point, axis));
+            high[axis] = std::max(high[axis], data.at(point, axis));
+        }
+    }
+
+    const double cells = (double) ((1ull << bits) - 1);
+    std::vector<double> scale(axes);
+    for (unsigned int axis = 0; axis < axes; axis++) {
+        scale[axis] = (highest[axis] > lowest[axis])? cells / (highest[axis] - lowest[axis]): 0;
+    }
+
+    std::vector<std::pair<uint64_t, size_t>> keys(points);
+    #pragma omp parallel for if(parallel)
+    for (long long point = 0; point < points; point++) {
+        uint32_t x[MAX_AXES];
+        for (unsigned int axis = 0; axis < axes; axis++) {
+            x[axis] = (uint32_t) std::min(cells, (data.at(point, axis) - lowest[axis]) * scale[axis]);
+        }
+        if (hilbert) {
+            hilbert_transpose(x, bits, axes);
+        }
+        keys[point] = std::make_pair(interleave(x, bits, axes), (size_t) point);
+    }
+
+    std::sort(keys.begin(), keys.end());
+    for (long long point = 0; point < points; point++) {
+        order[point] = keys[point].second;
+    }
+
+    return order;
+}
+
+// Copy of <data> holding row order[i] at row i, with the same precision and shard placement
+DataFrame permute_rows(const DataFrame &data, const std::vector<size_t> &order, bool parallel) {
+    const long long rows = order.size();
+    const unsigned int dimension = data.dimension();
+    DataFrame permuted;
+
+    if (data.single()) {
+        std::vector<float> values(rows * dimension);
+        #pragma omp parallel for schedule(static) if(parallel)
+        for (long long row = 0; row < rows; row++) {
+            std::copy_n(data.row<float>(order[row]), dimension, &values[row * dimension]);
+        }
+        permuted = DataFrame(std::move(values), dimension);
+    } else {
+        std::vector<double> values(rows * dimension);
+        #pragma omp parallel for schedule(static) if(parallel)
+        for (long long row = 0; row < rows; row++) {
+            std::copy_n(data[order[row]], dimension, &values[row * dimension]);
+        }
+        permuted = DataFrame(std::move(values), dimension);
+    }
+
+    // The vectors were zeroed by one thread, --numa places the copy like the loaded rows
+    if (numa_on && parallel) {
+        permuted.place();
+    }
+
+    permuted.shard(data.offset(), data.total());
+    return permuted;
+}
+
+// Follow the cycles of <order>, so every value moves once and only one row is held aside
+template <typename T>
+static void permute_in_place(T *values, size_t width, const std::vector<size_t> &order) {
+    std::vector<bool> done(order.size(), false);
+    std::vector<T> held(width);
+
+    for (size_t start = 0; start < order.size(); start++) {
+        if (done[start] || order[start] == start) {
+            continue;
+        }
+
+        std::copy_n(values + start * width, width, held.begin());
+        size_t row = start;
+        while (order[row] != start) {
+            std::copy_n(values + order[row] * width, width, values + row * width);
+            done[row] = true;
+            row = order[row];
+        }
+        std::copy_n(held.begin(), width, values + row * width);
+        done[row] = true;
+    }
+}
+
+void DataFrame::permute(const std::vector<size_t> &order) {
+    if (is_single) {
+        permute_in_place(mapping? single_mapped: single_values.data(), dims, order);
+    } else {
+        permute_in_place(data(), dims, order);
+    }
+}
+
+void permute_labels(unsigned int *labels, const std::vector<size_t> &order) {
+    permute_in_place(labels, 1, order);
+}
+
+ClusterSort::ClusterSort(const DataFrame &data, unsigned int *point_clusters, unsigned int k, int every, int first_iteration)
+    : data(data), point_clusters(point_clusters), k(k), every(every), first_iteration(first_iteration) {}
+
+void ClusterSort::sort(int iteration, bool parallel) {
+    if (every <= 0 || iteration == first_iteration || (iteration - first_iteration) % every != 0) {
+        return;
+    }
+
+    const DataFrame &current = rows();
+    const unsigned int *labels = this->labels();
+    const long long points = current.size();
+
+    // Stable counting sort, clusters in ascending order and the rows of one cluster in their current order
+    std::vector<size_t> starts(k + 2, 0), permutation(points);
+    for (long long point = 0; point < points; point++) {
+        starts[labels[point] + 1] += 1;
+    }
+    for (unsigned int cluster = 1; cluster <= k + 1; cluster++) {
+        starts[cluster] += starts[cluster - 1];
+    }
+    for (long long point = 0; point < points; point++) {
+        permutation[starts[labels[point]]++] = point;
+    }
+
+    DataFrame rows = permute_rows(current, permutation, parallel);
+    std::vector<unsigned int> sorted_labels(points);
+    std::vector<size_t> sorted_order(points);
+    #pragma omp parallel for if(parallel)
+    for (long long point = 0; point < points; point++) {
+        sorted_labels[point] = labels[permutation[point]];
+        sorted_order[point] = sorted? order[permutation[point]]: permutation[point];
+    }
+
+    working = std::move(rows);
+    working_labels.swap(sorted_labels);
+    order.swap(sorted_order);
+    sorted = true;
+}
+
+void ClusterSort::finish(bool parallel) {
+    if (!sorted) {
+        return;
+    }
+
+    #pragma omp parallel for if(parallel)
+    for (long long point = 0; point < (long long) order.size(); point++) {
+        point_clusters[order[point]] = working_labels[point];
+    }
+}
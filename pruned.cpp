@@ -0,0 +1,628 @@
+#include <omp.h>
+#include <mpi.h>
+#include <math.h>
+#include <algorithm>
+#include "kmeans.h"
+#include "trace.h"
+#include "checkpoint.h"
+
+// Trailing slots of the means buffer, every rank fills them with the totals of the iteration
+#define STATUS_CHANGED      0
+#define STATUS_INERTIA      1
+#define STATUS_SHIFT        2
+#define STATUS_EVALUATIONS  3
+#define STATUS_SLOTS        4
+
+static double distance(const double *first, const double *second, unsigned int dimension) {
+    return sqrt(squared_euclidean_distance(first, second, dimension));
+}
+
+// Combine the shard sums (inertia last) and counts (changed points and evaluations last) with one MPI_Allreduce
+// and divide them into new means on every rank, <moved> gets how far every centroid went. Between the full sums
+// of --incremental they are deltas, added to the <running> totals.
+static void update_centroids(std::vector<double> &means, std::vector<double> &old_means,
+                             const std::vector<double> &sums, const std::vector<long long> &counts,
+                             unsigned int k, unsigned int dimension, std::vector<double> &moved,
+                             RunningTotals &running, int iteration, bool distributed, MPI_Comm comm) {
+    const int values = k * dimension;
+
+    // Counts travel as doubles after the sums, exact up to 2^53, then the inertia, changed points and evaluations
+    std::vector<double> totals(values + k + 3);
+    std::copy_n(sums.begin(), values, totals.begin());
+    std::copy_n(counts.begin(), k, totals.begin() + values);
+    totals[values + k] = sums[values];
+    totals[values + k + 1] = counts[k];
+    totals[values + k + 2] = counts[k + 1];
+    const double *total_counts = &totals[values];
+
+    if (distributed) {
+        TraceSpan span(TRACE_COMMUNICATE);
+        std::vector<double> deltas(totals);
+        if (running.full(iteration) || !running.exchange(deltas.data(), totals.data(), 3, comm)) {
+            MPI_Allreduce(MPI_IN_PLACE, totals.data(), totals.size(), MPI_DOUBLE, MPI_SUM, comm);
+        }
+    }
+
+    TraceSpan span(TRACE_UPDATE);
+    running.apply(iteration, totals.data());
+    std::copy_n(means.begin(), values, old_means.begin());
+
+    // Divide sums by counts to get new centroids
+    double shift = 0;
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        const double count = std::max(1.0, total_counts[cluster]);
+        double travelled = 0;
+        for (unsigned int d = 0; d < dimension; d++) {
+            const double value = totals[cluster * dimension + d] / count;
+            travelled += square(value - means[cluster * dimension + d]);
+            means[cluster * dimension + d] = value;
+        }
+        shift = std::max(shift, sqrt(travelled));
+    }
+
+    means[values + STATUS_CHANGED] = total_counts[k + 1];
+    means[values + STATUS_INERTIA] = total_counts[k];
+    means[values + STATUS_SHIFT] = shift;
+    means[values + STATUS_EVALUATIONS] = total_counts[k + 2];
+
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        moved[cluster] = distance(&old_means[cluster * dimension], &means[cluster * dimension], dimension);
+    }
+}
+
+// Count the run's evaluations and apply the stopping rules to the totals every rank received
+static bool finish_iteration(const KMeansOptions &options, KMeansSummary &summary, const std::vector<double> &means, int values) {
+    summary.distance_evaluations += means[values + STATUS_EVALUATIONS];
+    trace_count(TRACE_CHANGED, means[values + STATUS_CHANGED]);
+    trace_count(TRACE_INERTIA, means[values + STATUS_INERTIA]);
+    trace_count(TRACE_SHIFT, means[values + STATUS_SHIFT]);
+    return should_stop(options, summary, means[values + STATUS_CHANGED], means[values + STATUS_INERTIA], means[values + STATUS_SHIFT]);
+}
+
+// The per-iteration inertia sums upper bounds, this is the exact one of the last assignment
+static double exact_inertia(const DataFrame &data, const unsigned int *point_clusters, const std::vector<double> &old_means,
+                            unsigned int dimension, bool distributed, MPI_Comm comm, bool parallel) {
+    double inertia = 0;
+    #pragma omp parallel for reduction(+:inertia) if(parallel)
+    for (long long point = 0; point < (long long) data.size(); point++) {
+        inertia += squared_euclidean_distance(data[point], &old_means[point_clusters[point] * dimension], dimension);
+    }
+
+    if (distributed) {
+        MPI_Allreduce(MPI_IN_PLACE, &inertia, 1, MPI_DOUBLE, MPI_SUM, comm);
+    }
+
+    return inertia;
+}
+
+// Elkan keeps a lower bound per point and centroid, Hamerly a single one to the second closest centroid.
+// Bounds live with the shard, so the distributed variants communicate exactly like kmeansMPI/kmeansHybrid.
+static DataFrame kmeansPruned(const DataFrame &data, unsigned int k, unsigned int *point_clusters,
+                              const KMeansOptions &options, KMeansSummary &summary,
+                              bool elkan, bool distributed, bool parallel) {
+    unsigned int dimension = data.dimension();
+    if (distributed) {
+        MPI_Allreduce(MPI_IN_PLACE, &dimension, 1, MPI_UNSIGNED, MPI_MAX, options.comm);
+    }
+
+    summary = KMeansSummary();
+
+    const long long points = data.size();
+    const int values = k * dimension;
+    const unsigned int bounds = elkan? k: 1;
+
+    std::vector<double> means(values + STATUS_SLOTS, 0), old_means(values, 0);
+    Checkpoint checkpoint(options, k, dimension, distributed);
+    int first_iteration = checkpoint.resume(means.data(), summary);
+    if (first_iteration < 0) {
+        TraceSpan span(TRACE_SEED);
+        initialize_means(data, k, dimension, means.data(), options, distributed, parallel);
+        first_iteration = 0;
+    }
+
+    std::vector<double> upper(points), lower(points * bounds);
+    std::vector<double> between(k * k), half_nearest(k), moved(k);
+    std::vector<double> sums(values + 1);
+    std::vector<long long> counts(k + 2);
+    RunningTotals running(k, dimension, options.incremental, first_iteration);
+
+    for (int iteration = first_iteration; iteration < options.max_iterations; iteration++) {
+        trace_iteration(iteration);
+
+        // Centroid to centroid distances, every rank computes the same ones
+        for (unsigned int cluster = 0; cluster < k; cluster++) {
+            half_nearest[cluster] = std::numeric_limits<double>::max();
+            for (unsigned int other = 0; other < k; other++) {
+                between[cluster * k + other] = distance(&means[cluster * dimension], &means[other * dimension], dimension);
+                if (other != cluster) {
+                    half_nearest[cluster] = std::min(half_nearest[cluster], 0.5 * between[cluster * k + other]);
+                }
+            }
+        }
+
+        const bool delta = !running.full(iteration);
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+
+        long long changed = 0, evaluations = 0;
+        double inertia = 0;
+        double *sum = sums.data();
+        long long *count = counts.data();
+        double assign_begin = trace_on? trace_now(): 0;
+
+        // Find the point belongs to which cluster, skipping every centroid the bounds rule out
+        #pragma omp parallel for schedule(dynamic, 1024) reduction(+:changed, evaluations, inertia) reduction(+:sum[:values], count[:k]) if(parallel)
+        for (long long point = 0; point < points; point++) {
+            const double *row = data[point];
+            double *lower_bounds = &lower[point * bounds];
+            const unsigned int previous = point_clusters[point];
+            unsigned int cluster = previous;
+            double bound = upper[point];
+
+            if (iteration == first_iteration) {
+                // The first pass computes every distance to start from exact bounds, a resumed run rebuilds them too
+                double second = std::numeric_limits<double>::max();
+                bound = std::numeric_limits<double>::max();
+                for (unsigned int other = 0; other < k; other++) {
+                    const double current = distance(row, &means[other * dimension], dimension);
+                    if (elkan) {
+                        lower_bounds[other] = current;
+                    }
+
+                    if (current < bound) {
+                        second = bound;
+                        bound = current;
+                        cluster = other;
+                    } else if (current < second) {
+                        second = current;
+                    }
+                }
+
+                if (!elkan) {
+                    lower_bounds[0] = second;
+                }
+
+                evaluations += k;
+            } else if (elkan) {
+                if (bound > half_nearest[cluster]) {
+                    bool tight = false;
+                    for (unsigned int other = 0; other < k; other++) {
+                        if (other == cluster || bound <= lower_bounds[other] || bound <= 0.5 * between[cluster * k + other]) {
+                            continue;
+                        }
+
+                        if (!tight) {
+                            bound = distance(row, &means[cluster * dimension], dimension);
+                            lower_bounds[cluster] = bound;
+                            evaluations += 1;
+                            tight = true;
+
+                            if (bound <= lower_bounds[other] || bound <= 0.5 * between[cluster * k + other]) {
+                                continue;
+                            }
+                        }
+
+                        const double current = distance(row, &means[other * dimension], dimension);
+                        lower_bounds[other] = current;
+                        evaluations += 1;
+
+                        if (current < bound) {
+                            cluster = other;
+                            bound = current;
+                        }
+                    }
+                }
+            } else {
+                const double limit = std::max(lower_bounds[0], half_nearest[cluster]);
+                if (bound > limit) {
+                    bound = distance(row, &means[cluster * dimension], dimension);
+                    evaluations += 1;
+
+                    if (bound > limit) {
+                        double second = std::numeric_limits<double>::max();
+                        bound = std::numeric_limits<double>::max();
+                        for (unsigned int other = 0; other < k; other++) {
+                            const double current = distance(row, &means[other * dimension], dimension);
+                            if (current < bound) {
+                                second = bound;
+                                bound = current;
+                                cluster = other;
+                            } else if (current < second) {
+                                second = current;
+                            }
+                        }
+
+                        lower_bounds[0] = second;
+                        evaluations += k;
+                    }
+                }
+            }
+
+            if (iteration == first_iteration || cluster != previous) {
+                changed += 1;
+            }
+
+            point_clusters[point] = cluster;
+            upper[point] = bound;
+            inertia += bound * bound;
+
+            // Sum up and count points for each cluster, between full sums only the ones that moved
+            if (!delta || cluster != previous) {
+                for (unsigned int d = 0; d < dimension; d++) {
+                    sum[cluster * dimension + d] += row[d];
+                }
+                count[cluster] += 1;
+            }
+            if (delta && cluster != previous) {
+                for (unsigned int d = 0; d < dimension; d++) {
+                    sum[previous * dimension + d] -= row[d];
+                }
+                count[previous] -= 1;
+            }
+        }
+
+        if (trace_on) {
+            trace_record(TRACE_ASSIGN, assign_begin, trace_now());
+        }
+
+        sums[values] = inertia;
+        counts[k] = changed;
+        counts[k + 1] = evaluations;
+
+        update_centroids(means, old_means, sums, counts, k, dimension, moved, running, iteration, distributed, options.comm);
+
+        // Loosen the bounds by how far every centroid moved
+        unsigned int farthest = 0;
+        double largest = 0, second_largest = 0;
+        for (unsigned int cluster = 0; cluster < k; cluster++) {
+            if (moved[cluster] > largest) {
+                second_largest = largest;
+                largest = moved[cluster];
+                farthest = cluster;
+            } else if (moved[cluster] > second_largest) {
+                second_largest = moved[cluster];
+            }
+        }
+
+        TraceSpan bounds_span(TRACE_BOUNDS);
+        #pragma omp parallel for if(parallel)
+        for (long long point = 0; point < points; point++) {
+            const unsigned int cluster = point_clusters[point];
+            upper[point] += moved[cluster];
+
+            if (elkan) {
+                for (unsigned int other = 0; other < k; other++) {
+                    lower[point * k + other] = std::max(0.0, lower[point * k + other] - moved[other]);
+                }
+            } else {
+                lower[point] -= (cluster == farthest)? second_largest: largest;
+            }
+        }
+
+        // Every rank sees the same totals, so they all stop in the same iteration
+        if (finish_iteration(options, summary, means, values)) {
+            break;
+        }
+        checkpoint.save(iteration + 1, means.data(), summary);
+    }
+
+    if (summary.iterations > first_iteration) {
+        summary.inertia = exact_inertia(data, point_clusters, old_means, dimension, distributed, options.comm, parallel);
+    }
+
+    DataFrame return_means(k, dimension);
+    std::copy_n(means.begin(), values, return_means.data());
+
+    return return_means;
+}
+
+// Split the centroids into <groups> groups with a few Lloyd steps over the centroids themselves,
+// deterministic so every rank ends up with the same groups
+static void group_centroids(const std::vector<double> &means, unsigned int k, unsigned int dimension, unsigned int groups,
+                            std::vector<unsigned int> &group_of, std::vector<unsigned int> &group_start, std::vector<unsigned int> &members) {
+    std::vector<double> centers(groups * dimension);
+    for (unsigned int group = 0; group < groups; group++) {
+        std::copy_n(&means[(size_t) group * k / groups * dimension], dimension, &centers[group * dimension]);
+    }
+
+    const NearestCentroid nearest = select_nearest_centroid(dimension);
+    Centroids packed;
+    for (int step = 0; step < 5; step++) {
+        packed.pack(centers.data(), groups, dimension);
+        for (unsigned int cluster = 0; cluster < k; cluster++) {
+            double distance;
+            group_of[cluster] = nearest(&means[cluster * dimension], packed, &distance);
+        }
+
+        std::vector<double> sums(groups * dimension, 0);
+        std::vector<unsigned int> sizes(groups, 0);
+        for (unsigned int cluster = 0; cluster < k; cluster++) {
+            for (unsigned int d = 0; d < dimension; d++) {
+                sums[group_of[cluster] * dimension + d] += means[cluster * dimension + d];
+            }
+            sizes[group_of[cluster]] += 1;
+        }
+
+        for (unsigned int group = 0; group < groups; group++) {
+            for (unsigned int d = 0; d < dimension && sizes[group] > 0; d++) {
+                centers[group * dimension + d] = sums[group * dimension + d] / sizes[group];
+            }
+        }
+    }
+
+    // Members of every group stored back to back
+    std::fill(group_start.begin(), group_start.end(), 0);
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        group_start[group_of[cluster] + 1] += 1;
+    }
+    for (unsigned int group = 0; group < groups; group++) {
+        group_start[group + 1] += group_start[group];
+    }
+
+    std::vector<unsigned int> next(group_start.begin(), group_start.end() - 1);
+    for (unsigned int cluster = 0; cluster < k; cluster++) {
+        members[next[group_of[cluster]]++] = cluster;
+    }
+}
+
+// Yinyang (Ding et al.) keeps one lower bound per point and group of centroids, O(N * groups) memory
+// instead of Elkan's O(N * k), and filters whole groups before looking at single centroids
+static DataFrame kmeansYinyang(const DataFrame &data, unsigned int k, unsigned int *point_clusters,
+                               const KMeansOptions &options, KMeansSummary &summary, bool distributed, bool parallel) {
+    unsigned int dimension = data.dimension();
+    if (distributed) {
+        MPI_Allreduce(MPI_IN_PLACE, &dimension, 1, MPI_UNSIGNED, MPI_MAX, options.comm);
+    }
+
+    summary = KMeansSummary();
+
+    const long long points = data.size();
+    const int values = k * dimension;
+    const unsigned int groups = (options.groups > 0)? std::min(options.groups, k): std::max(1u, k / 10);
+
+    std::vector<double> means(values + STATUS_SLOTS, 0), old_means(values, 0);
+    Checkpoint checkpoint(options, k, dimension, distributed);
+    int first_iteration = checkpoint.resume(means.data(), summary);
+    if (first_iteration < 0) {
+        TraceSpan span(TRACE_SEED);
+        initialize_means(data, k, dimension, means.data(), options, distributed, parallel);
+        first_iteration = 0;
+    }
+
+    std::vector<unsigned int> group_of(k), group_start(groups + 1), members(k);
+    group_centroids(means, k, dimension, groups, group_of, group_start, members);
+
+    std::vector<double> upper(points), lower(points * groups);
+    std::vector<double> moved(k), group_moved(groups);
+    std::vector<double> sums(values + 1);
+    std::vector<long long> counts(k + 2);
+    RunningTotals running(k, dimension, options.incremental, first_iteration);
+
+    for (int iteration = first_iteration; iteration < options.max_iterations; iteration++) {
+        trace_iteration(iteration);
+        const bool delta = !running.full(iteration);
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+
+        long long changed = 0, evaluations = 0;
+        double inertia = 0;
+        double *sum = sums.data();
+        long long *count = counts.data();
+        double assign_begin = trace_on? trace_now(): 0;
+
+        #pragma omp parallel reduction(+:changed, evaluations, inertia) reduction(+:sum[:values], count[:k]) if(parallel)
+        {
+            std::vector<double> start(groups), second(groups);
+
+            // Find the point belongs to which cluster, skipping every group the bounds rule out
+            #pragma omp for schedule(dynamic, 1024)
+            for (long long point = 0; point < points; point++) {
+                const double *row = data[point];
+                double *lower_bounds = &lower[point * groups];
+                const unsigned int previous = point_clusters[point];
+                unsigned int cluster = previous;
+                double bound = upper[point];
+
+                if (iteration == first_iteration) {
+                    // The first pass computes every distance to start from exact bounds
+                    std::fill(lower_bounds, lower_bounds + groups, std::numeric_limits<double>::max());
+                    std::fill(second.begin(), second.end(), std::numeric_limits<double>::max());
+                    bound = std::numeric_limits<double>::max();
+
+                    for (unsigned int other = 0; other < k; other++) {
+                        const double current = distance(row, &means[other * dimension], dimension);
+                        const unsigned int group = group_of[other];
+                        if (current < lower_bounds[group]) {
+                            second[group] = lower_bounds[group];
+                            lower_bounds[group] = current;
+                        } else if (current < second[group]) {
+                            second[group] = current;
+                        }
+
+                        if (current < bound) {
+                            bound = current;
+                            cluster = other;
+                        }
+                    }
+
+                    // The own group is bounded by its second closest centroid
+                    lower_bounds[group_of[cluster]] = second[group_of[cluster]];
+                    evaluations += k;
+                } else {
+                    const double global_lower = *std::min_element(lower_bounds, lower_bounds + groups);
+                    if (bound > global_lower) {
+                        bound = distance(row, &means[cluster * dimension], dimension);
+                        evaluations += 1;
+                    }
+
+                    if (bound > global_lower) {
+                        const unsigned int previous = cluster;
+                        const double own = bound;
+                        std::copy_n(lower_bounds, groups, start.begin());
+
+                        for (unsigned int group = 0; group < groups; group++) {
+                            if (lower_bounds[group] >= bound) {
+                                continue;
+                            }
+
+                            // The bound of the group before the drift rules out single centroids that barely moved
+                            const double before_drift = start[group] + group_moved[group];
+                            double first = std::numeric_limits<double>::max(), next = std::numeric_limits<double>::max();
+                            unsigned int first_cluster = cluster;
+
+                            for (unsigned int member = group_start[group]; member < group_start[group + 1]; member++) {
+                                const unsigned int other = members[member];
+                                if (other == cluster) {
+                                    continue;
+                                }
+
+                                double current = before_drift - moved[other];
+                                if (other == previous) {
+                                    current = own;
+                                } else if (current < bound) {
+                                    current = distance(row, &means[other * dimension], dimension);
+                                    evaluations += 1;
+                                }
+
+                                if (current < first) {
+                                    next = first;
+                                    first = current;
+                                    first_cluster = other;
+                                } else if (current < next) {
+                                    next = current;
+                                }
+                            }
+
+                            if (first < bound) {
+                                // The replaced centroid becomes a bound of its own group
+                                const unsigned int replaced = cluster;
+                                const double replaced_distance = bound;
+                                cluster = first_cluster;
+                                bound = first;
+
+                                if (group_of[replaced] == group) {
+                                    lower_bounds[group] = std::min(next, replaced_distance);
+                                } else {
+                                    lower_bounds[group] = next;
+                                    lower_bounds[group_of[replaced]] = std::min(lower_bounds[group_of[replaced]], replaced_distance);
+                                }
+                            } else {
+                                lower_bounds[group] = first;
+                            }
+                        }
+                    }
+                }
+
+                if (iteration == first_iteration || cluster != previous) {
+                    changed += 1;
+                }
+
+                point_clusters[point] = cluster;
+                upper[point] = bound;
+                inertia += bound * bound;
+
+                // Sum up and count points for each cluster, between full sums only the ones that moved
+                if (!delta || cluster != previous) {
+                    for (unsigned int d = 0; d < dimension; d++) {
+                        sum[cluster * dimension + d] += row[d];
+                    }
+                    count[cluster] += 1;
+                }
+                if (delta && cluster != previous) {
+                    for (unsigned int d = 0; d < dimension; d++) {
+                        sum[previous * dimension + d] -= row[d];
+                    }
+                    count[previous] -= 1;
+                }
+            }
+        }
+
+        if (trace_on) {
+            trace_record(TRACE_ASSIGN, assign_begin, trace_now());
+        }
+
+        sums[values] = inertia;
+        counts[k] = changed;
+        counts[k + 1] = evaluations;
+
+        update_centroids(means, old_means, sums, counts, k, dimension, moved, running, iteration, distributed, options.comm);
+
+        // Loosen the bounds by how far every centroid and every group moved
+        std::fill(group_moved.begin(), group_moved.end(), 0.0);
+        for (unsigned int cluster = 0; cluster < k; cluster++) {
+            group_moved[group_of[cluster]] = std::max(group_moved[group_of[cluster]], moved[cluster]);
+        }
+
+        TraceSpan bounds_span(TRACE_BOUNDS);
+        #pragma omp parallel for if(parallel)
+        for (long long point = 0; point < points; point++) {
+            upper[point] += moved[point_clusters[point]];
+            for (unsigned int group = 0; group < groups; group++) {
+                lower[point * groups + group] -= group_moved[group];
+            }
+        }
+
+        // Every rank sees the same totals, so they all stop in the same iteration
+        if (finish_iteration(options, summary, means, values)) {
+            break;
+        }
+        checkpoint.save(iteration + 1, means.data(), summary);
+    }
+
+    if (summary.iterations > first_iteration) {
+        summary.inertia = exact_inertia(data, point_clusters, old_means, dimension, distributed, options.comm, parallel);
+    }
+
+    DataFrame return_means(k, dimension);
+    std::copy_n(means.begin(), values, return_means.data());
+
+    return return_means;
+}
+
+DataFrame kmeansElkanSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansPruned(data, k, point_clusters, options, summary, true, false, false);
+}
+
+DataFrame kmeansElkanOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansPruned(data, k, point_clusters, options, summary, true, false, true);
+}
+
+DataFrame kmeansElkanMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansPruned(data, k, point_clusters, options, summary, true, true, false);
+}
+
+DataFrame kmeansElkanHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansPruned(data, k, point_clusters, options, summary, true, true, true);
+}
+
+DataFrame kmeansHamerlySerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansPruned(data, k, point_clusters, options, summary, false, false, false);
+}
+
+DataFrame kmeansHamerlyOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansPruned(data, k, point_clusters, options, summary, false, false, true);
+}
+
+DataFrame kmeansHamerlyMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansPruned(data, k, point_clusters, options, summary, false, true, false);
+}
+
+DataFrame kmeansHamerlyHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansPruned(data, k, point_clusters, options, summary, false, true, true);
+}
+
+DataFrame kmeansYinyangSerial(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansYinyang(data, k, point_clusters, options, summary, false, false);
+}
+
+DataFrame kmeansYinyangOMP(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansYinyang(data, k, point_clusters, options, summary, false, true);
+}
+
+DataFrame kmeansYinyangMPI(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansYinyang(data, k, point_clusters, options, summary, true, false);
+}
+
+DataFrame kmeansYinyangHybrid(const DataFrame &data, unsigned int k, unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    return kmeansYinyang(data, k, point_clusters, options, summary, true, true);
+}
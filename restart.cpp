@@ -0,0 +1,218 @@
+#include <omp.h>
+#include <mpi.h>
+#include <algorithm>
+#include "kmeans.h"
+#include "trace.h"
+
+#define MASTER      0
+
+// Restart r is seeded with seed + r, so restart 0 is the same run as without --n-init
+static KMeansOptions restart_options(const KMeansOptions &options, unsigned int restart, MPI_Comm comm) {
+    KMeansOptions restart_options = options;
+    restart_options.seed = options.seed + restart;
+    restart_options.comm = comm;
+    return restart_options;
+}
+
+// Lower inertia wins, ties go to the earlier restart so the pick does not depend on scheduling
+static bool better(const KMeansSummary &summary, const KMeansSummary &best) {
+    return summary.inertia < best.inertia || (summary.inertia == best.inertia && summary.restart < best.restart);
+}
+
+// serial and omp: the threads are split into teams that each run whole restarts over the shared points,
+// keeping their best labels, so memory grows by two label arrays per team
+static DataFrame restarts_shared(const std::string &algorithm, bool parallel, const DataFrame &data, unsigned int k,
+                                 unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    const int threads = parallel? omp_get_max_threads(): 1;
+    const int teams = std::min<int>(options.n_init, threads);
+    const int team_threads = threads / teams;
+    const KMeans kmeans = find_engine(algorithm, (team_threads > 1)? "omp": "serial");
+
+    std::vector<DataFrame> best_means(teams);
+    std::vector<KMeansSummary> best_summary(teams);
+    std::vector<std::vector<unsigned int>> best_clusters(teams);
+    std::vector<long long> evaluations(teams, 0);
+
+    const int levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+    trace_teams(true);
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(teams)
+    for (unsigned int restart = 0; restart < options.n_init; restart++) {
+        const int team = omp_get_thread_num();
+        omp_set_num_threads(team_threads);
+
+        std::vector<unsigned int> clusters(data.size());
+        KMeansSummary restart_summary;
+        DataFrame means = kmeans(data, k, clusters.data(), restart_options(options, restart, MPI_COMM_WORLD), restart_summary);
+        restart_summary.restart = restart;
+        evaluations[team] += restart_summary.distance_evaluations;
+
+        if (best_clusters[team].empty() || better(restart_summary, best_summary[team])) {
+            best_means[team] = std::move(means);
+            best_summary[team] = restart_summary;
+            best_clusters[team].swap(clusters);
+        }
+    }
+
+    trace_teams(false);
+    omp_set_max_active_levels(levels);
+
+    int winner = 0;
+    for (int team = 1; team < teams; team++) {
+        if (!best_clusters[team].empty() && better(best_summary[team], best_summary[winner])) {
+            winner = team;
+        }
+    }
+
+    // The summary is the winner's, the distance evaluations count the work of every restart
+    summary = best_summary[winner];
+    summary.distance_evaluations = 0;
+    for (int team = 0; team < teams; team++) {
+        summary.distance_evaluations += evaluations[team];
+    }
+    std::copy(best_clusters[winner].begin(), best_clusters[winner].end(), point_clusters);
+
+    return best_means[winner];
+}
+
+// mpi and hybrid: the ranks are split into groups that run restarts side by side with MPI_Comm_split. Rank r
+// joins group r % groups, and the <groups> consecutive ranks of a row gather their shards, so every group
+// holds the whole dataset spread over its members at the cost of <groups> copies of it.
+static DataFrame restarts_distributed(const std::string &algorithm, const std::string &command, const DataFrame &data, unsigned int k,
+                                      unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    int world_size, world_rank;
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    // Every group needs the same number of ranks
+    int groups = std::min<int>(options.n_init, world_size);
+    while (world_size % groups != 0) {
+        groups -= 1;
+    }
+
+    const int group = world_rank % groups;
+    MPI_Comm group_comm, row_comm;
+    MPI_Comm_split(MPI_COMM_WORLD, group, world_rank, &group_comm);
+    MPI_Comm_split(MPI_COMM_WORLD, world_rank / groups, world_rank, &row_comm);
+
+    unsigned int dimension = data.dimension();
+    unsigned long long seed = options.seed;
+    MPI_Allreduce(MPI_IN_PLACE, &dimension, 1, MPI_UNSIGNED, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Bcast(&seed, 1, MPI_UNSIGNED_LONG_LONG, MASTER, MPI_COMM_WORLD);
+
+    // Shards of a row are consecutive, so their union is one contiguous block of the dataset
+    MPI_Datatype row_type;
+    MPI_Type_contiguous(dimension, data.single()? MPI_FLOAT: MPI_DOUBLE, &row_type);
+    MPI_Type_commit(&row_type);
+
+    int count = data.size();
+    std::vector<int> lengths(groups), displacements(groups, 0);
+    MPI_Allgather(&count, 1, MPI_INT, lengths.data(), 1, MPI_INT, row_comm);
+    for (int member = 1; member < groups; member++) {
+        displacements[member] = displacements[member - 1] + lengths[member - 1];
+    }
+
+    DataFrame rows;
+    if (groups > 1) {
+        unsigned long long offset = data.offset();
+        MPI_Bcast(&offset, 1, MPI_UNSIGNED_LONG_LONG, MASTER, row_comm);
+
+        const size_t length = (size_t) (displacements[groups - 1] + lengths[groups - 1]) * dimension;
+        if (data.single()) {
+            std::vector<float> values(length);
+            MPI_Allgatherv(data.single_data(), count, row_type, values.data(), lengths.data(), displacements.data(), row_type, row_comm);
+            rows = DataFrame(std::move(values), dimension);
+        } else {
+            std::vector<double> values(length);
+            MPI_Allgatherv(data.data(), count, row_type, values.data(), lengths.data(), displacements.data(), row_type, row_comm);
+            rows = DataFrame(std::move(values), dimension);
+        }
+        rows.shard(offset, data.total());
+    }
+    const DataFrame &shard = (groups > 1)? rows: data;
+
+    // --order positions are local to every member, shift them by where its rows landed in the union
+    std::vector<size_t> positions;
+    if (groups > 1 && options.positions != NULL) {
+        std::vector<unsigned long long> local(options.positions, options.positions + count), gathered(shard.size());
+        MPI_Allgatherv(local.data(), count, MPI_UNSIGNED_LONG_LONG, gathered.data(), lengths.data(), displacements.data(),
+                       MPI_UNSIGNED_LONG_LONG, row_comm);
+        positions.resize(shard.size());
+        for (int member = 0; member < groups; member++) {
+            for (int row = displacements[member]; row < displacements[member] + lengths[member]; row++) {
+                positions[row] = gathered[row] + displacements[member];
+            }
+        }
+    }
+
+    const KMeans kmeans = find_engine(algorithm, command);
+    KMeansSummary best_summary;
+    DataFrame best_means;
+    std::vector<unsigned int> clusters(shard.size()), best_clusters;
+    long long evaluations = 0;
+
+    KMeansOptions group_options = options;
+    group_options.seed = seed;
+    if (!positions.empty()) {
+        group_options.positions = positions.data();
+    }
+    for (unsigned int restart = group; restart < options.n_init; restart += groups) {
+        KMeansSummary restart_summary;
+        DataFrame means = kmeans(shard, k, clusters.data(), restart_options(group_options, restart, group_comm), restart_summary);
+        restart_summary.restart = restart;
+        evaluations += restart_summary.distance_evaluations;
+
+        if (best_clusters.empty() || better(restart_summary, best_summary)) {
+            best_means = std::move(means);
+            best_summary = restart_summary;
+            best_clusters.swap(clusters);
+            clusters.resize(shard.size());
+        }
+    }
+
+    // MINLOC on (inertia, restart) breaks ties towards the earlier restart like better()
+    struct { double inertia; int restart; } local = { best_summary.inertia, (int) best_summary.restart }, best;
+    MPI_Allreduce(&local, &best, 1, MPI_DOUBLE_INT, MPI_MINLOC, MPI_COMM_WORLD);
+    const int winner = best.restart % groups;
+
+    // One member of every row belongs to the winning group, it hands the labels of the row to the others
+    best_clusters.resize(shard.size());
+    MPI_Bcast(best_clusters.data(), best_clusters.size(), MPI_UNSIGNED, winner, row_comm);
+    std::copy_n(&best_clusters[displacements[group]], data.size(), point_clusters);
+
+    // World rank <winner> is the first member of the winning group
+    double status[5] = { (double) best_summary.iterations, (double) best_summary.converged, (double) best_summary.changed,
+                         best_summary.inertia, best_summary.shift };
+    MPI_Bcast(status, 5, MPI_DOUBLE, winner, MPI_COMM_WORLD);
+    best_means.resize(k, dimension);
+    MPI_Bcast(best_means.data(), k * dimension, MPI_DOUBLE, winner, MPI_COMM_WORLD);
+
+    // Every group counted its restarts on all of its ranks, one member per row adds them up once
+    MPI_Allreduce(MPI_IN_PLACE, &evaluations, 1, MPI_LONG_LONG_INT, MPI_SUM, row_comm);
+
+    summary = KMeansSummary();
+    summary.iterations = status[0];
+    summary.converged = status[1];
+    summary.changed = status[2];
+    summary.inertia = status[3];
+    summary.shift = status[4];
+    summary.distance_evaluations = evaluations;
+    summary.restart = best.restart;
+
+    MPI_Type_free(&row_type);
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&group_comm);
+
+    return best_means;
+}
+
+// Run options.n_init independent restarts over the loaded points and keep the one with the lowest inertia
+DataFrame kmeansRestarts(const std::string &algorithm, const std::string &command, const DataFrame &data, unsigned int k,
+                         unsigned int *point_clusters, const KMeansOptions &options, KMeansSummary &summary) {
+    if (command == "mpi" || command == "hybrid") {
+        return restarts_distributed(algorithm, command, data, k, point_clusters, options, summary);
+    }
+
+    return restarts_shared(algorithm, command == "omp", data, k, point_clusters, options, summary);
+}
@@ -0,0 +1,322 @@
+#include <omp.h>
+#include <math.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <future>
+#include <algorithm>
+#include <filesystem>
+#include "kmeans.h"
+#include "trace.h"
+
+// Sequential reader of a point file that never holds more than one chunk of it
+class PointStream {
+public:
+    ~PointStream() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    int open(std::string filename, bool binary);
+    void rewind();
+    long long read(DataFrame &chunk, size_t count);
+    unsigned int dimension() const { return dims; }
+
+private:
+    std::filesystem::path pathname;
+    bool binary = false;
+    int fd = -1;
+    std::ifstream text;
+    uint64_t total = 0;
+    uint64_t position = 0;
+    unsigned int dims = 0;
+    bool single = false;
+    std::vector<float> single_values;
+    std::vector<char> lines;
+    std::vector<double> values;
+};
+
+int PointStream::open(std::string filename, bool binary) {
+    this->binary = binary;
+    pathname = std::filesystem::path("inputs") / std::filesystem::path(filename);
+
+    if (!binary) {
+        text.open(pathname, std::ifstream::in | std::ifstream::binary);
+        if (!text.is_open()) {
+            perror("stream error");
+            return -1;
+        }
+        return 0;
+    }
+
+    fd = ::open(pathname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        perror("stream error");
+        return -1;
+    }
+
+    BinaryHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, BINARY_MAGIC, sizeof(header.magic)) != 0 || header.version != BINARY_VERSION) {
+        fprintf(stderr, "stream error: %s is not a version %d point file\n", pathname.c_str(), BINARY_VERSION);
+        return -1;
+    }
+
+    if ((header.dtype != DTYPE_FLOAT64 && header.dtype != DTYPE_FLOAT32) || header.dimension == 0) {
+        fprintf(stderr, "stream error: only float64 or float32 points with a dimension are supported\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !holds_rows(header, st.st_size)) {
+        fprintf(stderr, "stream error: %s is truncated\n", pathname.c_str());
+        return -1;
+    }
+
+    total = header.count;
+    single = (header.dtype == DTYPE_FLOAT32);
+    dims = header.dimension;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    return 0;
+}
+
+void PointStream::rewind() {
+    position = 0;
+    if (!binary) {
+        text.clear();
+        text.seekg(0);
+    }
+}
+
+// Read up to <count> points into <chunk>, returns how many, 0 at the end of the file and -1 on errors
+long long PointStream::read(DataFrame &chunk, size_t count) {
+    if (binary) {
+        const size_t points = std::min<uint64_t>(count, total - position);
+        chunk.resize(points, dims);
+
+        // float32 files are read as they are and widened into the chunk
+        const size_t value_size = single? sizeof(float): sizeof(double);
+        if (single) {
+            single_values.resize(points * dims);
+        }
+        char *buffer = single? (char*) single_values.data(): (char*) chunk.data();
+
+        const size_t bytes = points * dims * value_size;
+        const off_t offset = sizeof(BinaryHeader) + position * dims * value_size;
+        size_t done = 0;
+        while (done < bytes) {
+            const ssize_t got = pread(fd, buffer + done, bytes - done, offset + done);
+            if (got <= 0) {
+                fprintf(stderr, "stream error: %s is truncated\n", pathname.c_str());
+                return -1;
+            }
+            done += got;
+        }
+
+        if (single) {
+            std::copy(single_values.begin(), single_values.end(), chunk.data());
+        }
+
+        position += points;
+        return points;
+    }
+
+    // Text rows are gathered line by line and parsed together. Blank lines and lines without values do not
+    // count, so more lines are read until the chunk is full of parsed rows or the file ends.
+    values.clear();
+    size_t rows = 0;
+    std::string line;
+    while (rows < count) {
+        lines.clear();
+        size_t gathered = 0;
+        while (rows + gathered < count && std::getline(text, line)) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            lines.insert(lines.end(), line.begin(), line.end());
+            lines.push_back('\n');
+            gathered += 1;
+        }
+
+        if (text.bad()) {
+            perror("stream error");
+            return -1;
+        }
+
+        if (gathered == 0) {
+            break;
+        }
+
+        lines.push_back('\0');
+        if (parse_points(lines.data(), lines.data() + lines.size() - 1, values, dims) == -1) {
+            return -1;
+        }
+        rows = (dims > 0)? values.size() / dims: 0;
+    }
+
+    chunk.resize(rows, dims);
+    std::copy(values.begin(), values.end(), chunk.data());
+    position += rows;
+
+    return rows;
+}
+
+// Sweep the whole file once, <consume> gets every chunk while the next one is being read
+template <typename Consume>
+static int sweep(PointStream &stream, DataFrame *buffers, size_t chunk_size, Consume consume) {
+    stream.rewind();
+
+    int current = 0;
+    long long count = stream.read(buffers[current], chunk_size);
+    while (count > 0) {
+        std::future<long long> next = std::async(std::launch::async, [&stream, &buffers, current, chunk_size]() {
+            return stream.read(buffers[1 - current], chunk_size);
+        });
+
+        if (consume(buffers[current]) == -1) {
+            next.wait();
+            return -1;
+        }
+
+        count = next.get();
+        current = 1 - current;
+    }
+
+    return (count == -1)? -1: 0;
+}
+
+// Lloyd over a file that does not fit in memory: every iteration streams it chunk by chunk into the sums
+// and counts, so only two chunks and the centroids are ever held. Labels are only kept per chunk, which
+// leaves the changed points unknown; convergence still shows as a zero shift.
+int kmeansStream(std::string filename, bool binary, unsigned int k, const KMeansOptions &options, KMeansSummary &summary,
+                 DataFrame &means, std::string output) {
+    PointStream stream;
+    if (stream.open(filename, binary) == -1) {
+        return -1;
+    }
+
+    // The reader fills one buffer while the other is swept
+    DataFrame buffers[2];
+    if (stream.read(buffers[0], options.chunk_size) <= 0) {
+        fprintf(stderr, "stream error: no points in %s\n", filename.c_str());
+        return -1;
+    }
+
+    // Seed the centroids from the first chunk with the chosen initializer
+    const unsigned int dimension = stream.dimension();
+    const bool single = (options.precision == "float");
+    const NearestCentroid nearest = select_nearest_centroid(dimension, single);
+    Centroids centroids;
+    summary = KMeansSummary();
+    means = DataFrame(k, dimension);
+    {
+        TraceSpan span(TRACE_SEED);
+        initialize_means(buffers[0], k, dimension, means.data(), options, false, true);
+    }
+
+    const int threads = omp_get_max_threads();
+    Accumulators accumulators(threads, k, dimension);
+    const double *totals = accumulators.counts(0);
+    long long points = 0;
+
+    for (int iteration = 0; iteration < options.max_iterations; iteration++) {
+        // Lay the current centroids out for the assignment kernel
+        trace_iteration(iteration);
+        centroids.pack(means.data(), k, dimension, single);
+
+        for (int thread = 0; thread < threads; thread++) {
+            accumulators.clear(thread);
+        }
+
+        points = 0;
+        const int status = sweep(stream, buffers, options.chunk_size, [&](const DataFrame &chunk) {
+            // Find the point belongs to which cluster and add it to the partials of its thread
+            #pragma omp parallel num_threads(threads)
+            {
+                const int thread_id = omp_get_thread_num();
+                double *sums = accumulators.sums(thread_id);
+                double *counts = accumulators.counts(thread_id);
+                double inertia = 0;
+
+                TraceSpan span(TRACE_ASSIGN);
+                #pragma omp for
+                for (long long point = 0; point < (long long) chunk.size(); point++) {
+                    double distance;
+                    const double *row = chunk[point];
+                    const unsigned int cluster = nearest(row, centroids, &distance);
+                    inertia += distance;
+
+                    for (unsigned int d = 0; d < dimension; d++) {
+                        sums[cluster * dimension + d] += row[d];
+                    }
+                    counts[cluster] += 1;
+                }
+
+                counts[k + TOTAL_INERTIA] += inertia;
+            }
+
+            points += chunk.size();
+            return 0;
+        });
+
+        if (status == -1) {
+            return -1;
+        }
+
+        #pragma omp parallel num_threads(threads)
+        {
+            TraceSpan span(TRACE_REDUCE);
+            accumulators.reduce(omp_get_thread_num(), omp_get_num_threads());
+        }
+
+        double shift;
+        {
+            TraceSpan span(TRACE_UPDATE);
+            shift = update_means(means.data(), accumulators.sums(0), totals, k, dimension, true);
+        }
+
+        summary.distance_evaluations += points * k;
+        trace_count(TRACE_INERTIA, totals[k + TOTAL_INERTIA]);
+        trace_count(TRACE_SHIFT, shift);
+
+        if (should_stop(options, summary, -1, totals[k + TOTAL_INERTIA], shift)) {
+            break;
+        }
+    }
+
+    if (output.empty()) {
+        return 0;
+    }
+
+    // Label the points chunk by chunk and append them to the output as they are done
+    centroids.pack(means.data(), k, dimension, single);
+    std::vector<unsigned int> labels(options.chunk_size);
+    double inertia = 0;
+    bool append = false;
+
+    const int status = sweep(stream, buffers, options.chunk_size, [&](DataFrame &chunk) {
+        #pragma omp parallel for reduction(+:inertia)
+        for (long long point = 0; point < (long long) chunk.size(); point++) {
+            double distance;
+            labels[point] = nearest(chunk[point], centroids, &distance);
+            inertia += distance;
+        }
+
+        const int written = writefile(output, chunk, labels.data(), append);
+        append = true;
+        return written;
+    });
+
+    if (status == -1) {
+        return -1;
+    }
+
+    summary.inertia = inertia;
+    summary.distance_evaluations += points * k;
+
+    return 0;
+}
@@ -7,54 +7,45 @@ MAXIMUM=1000000
 INFILE="data.txt"
 # kmeans
 CLUSTERS=3
-COMMANDS="serial omp mpi hybrid"
-RESULT="result"
+COMMANDS="serial,omp,mpi,hybrid"
+THREADS="1,2,4"
+RESULT="result.csv"
 HOSTFILE="hosts"
 
 #==== change default values from arguments ====#
-while getopts "c:f:" argv; do
+while getopts "c:n:" argv; do
     case $argv in
         c) CLUSTERS=$OPTARG ;;
-        f) INFILE=$OPTARG   ;;
+        n) NUMS=$OPTARG     ;;
     esac
 done
 
 #==== these lines should be executed before parallel-scp ====#
-# generate points
+# generate points (only needed to draw a result)
 #python3 generate.py -n $NUMS -m $MAXIMUM -f $INFILE
 # exeucute program
-#make clean && make
+#make clean && make && make bench
 
 #==== statistic ====#
-> $RESULT
-for COMMAND in $COMMANDS
-do 
-    if [ "$COMMAND" = "mpi" ]; then
-        mpirun -np 4 -x OMP_NUM_THREADS=4 --hostfile $HOSTFILE --bind-to core\
-        ./kmeans -c $CLUSTERS -f $INFILE --no-output $COMMAND | tee -a $RESULT
-    elif [ "$COMMAND" = "hybrid" ]; then
-        export OMP_PROC_BIND=true; export OMP_NUM_THREADS=4;
-        mpirun -np 4 -pernode --hostfile $HOSTFILE --bind-to none \
-        ./kmeans -c $CLUSTERS -f $INFILE --no-output $COMMAND | tee -a $RESULT
-    else
-        ./kmeans -c $CLUSTERS -f $INFILE --no-output $COMMAND | tee -a $RESULT
-    fi
-done
+# The benchmark repeats every run, serial and omp run on the first rank only
+export OMP_PROC_BIND=true; export OMP_NUM_THREADS=4;
+mpirun -np 4 -pernode --hostfile $HOSTFILE --bind-to none -x OMP_PROC_BIND -x OMP_NUM_THREADS \
+    ./bench -N $NUMS -c $CLUSTERS -e $COMMANDS -t $THREADS -o $RESULT
 
 # draw kmeans result (uncomment it if needed)
-#python3 draw.py -c $CLUSTERS -f $INFILE
+#./kmeans -c $CLUSTERS -f $INFILE serial && python3 draw.py -c $CLUSTERS -f $INFILE
 
 #==== output result ====#
 echo
 echo "K-Means clustering statistics"
 echo
 echo "======================================"
-awk -v BASETIME=$(awk 'NR==1{print $7}' $RESULT)\
+awk -F, -v BASETIME=$(awk -F, '$1=="serial"{print $10; exit}' $RESULT)\
     '\
-    BEGIN {printf "implementation\ttime(s)\tspeedup\n";\
-    printf "--------------\t-----------\t---------\n"}\
-    /Total/ { printf "%s\t%ss\t%.3fX\n", $5, $7, BASETIME / $7 }\
+    BEGIN {printf "implementation\tthreads\tranks\tmedian(s)\tp95(s)\tspeedup\n";\
+    printf "--------------\t-------\t-----\t---------\t------\t-------\n"}\
+    NR > 1 { printf "%s\t%s\t%s\t%ss\t%ss\t%.3fX\n", $1, $6, $7, $10, $11, BASETIME / $10 }\
     '\
     $RESULT | column -t
 echo "======================================"
-echo
\ No newline at end of file
+echo
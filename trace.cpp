@@ -0,0 +1,231 @@
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <time.h>
+#include <map>
+#include <tuple>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <sys/stat.h>
+#include "trace.h"
+
+#define MASTER      0
+#define MODE        0775
+#define FIELDS      6   // kind, iteration, rank, thread, begin, end (or value for counters)
+
+static const char *kind_names[TRACE_KINDS] = {
+    "seed", "assign", "reduce", "communicate", "update", "bounds", "changed", "inertia", "shift"
+};
+
+bool trace_on = false;
+static double origin = 0;
+
+// Iteration of every restart team, a single slot unless trace_teams marked concurrent restarts
+static std::vector<int> iterations;
+static int team_level = 0;
+
+// One buffer per thread so recording never locks, the rank is only filled in when they are gathered
+static std::vector<std::vector<double>> buffers;
+
+// Microseconds since trace_start, the unit of the Chrome trace format
+double trace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3 - origin;
+}
+
+void trace_start(bool distributed) {
+    buffers.assign(omp_get_max_threads(), std::vector<double>());
+    for (std::vector<double> &buffer : buffers) {
+        buffer.reserve(FIELDS * 1024);
+    }
+
+    // Every rank starts its clock after the same barrier, so the timelines line up
+    if (distributed) {
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+
+    origin = 0;
+    origin = trace_now();
+    iterations.assign(omp_get_max_threads(), -1);
+    trace_on = true;
+}
+
+void trace_teams(bool on) {
+    team_level = on? omp_get_level() + 1: 0;
+}
+
+// Restart team of the calling thread, the thread it descends from at the level of the restarts
+static int team() {
+    return (team_level > 0 && omp_get_level() >= team_level)? omp_get_ancestor_thread_num(team_level): 0;
+}
+
+void trace_iteration(int iteration) {
+    const int current = team();
+    if (current < (int) iterations.size()) {
+        iterations[current] = iteration;
+    }
+}
+
+// Flat index of the calling thread, the nested teams of concurrent restarts get disjoint ones
+static int flat_thread() {
+    int thread = 0;
+    for (int level = 1; level <= omp_get_level(); level++) {
+        thread = thread * omp_get_team_size(level) + omp_get_ancestor_thread_num(level);
+    }
+
+    // A team master between its sweeps records as thread 0 of its team, not as a thread of team 0
+    if (team_level > 0 && omp_get_level() == team_level) {
+        thread *= omp_get_max_threads();
+    }
+    return thread;
+}
+
+void trace_record(int kind, double begin, double end) {
+    const int thread = flat_thread(), current = team();
+    if (thread >= (int) buffers.size() || current >= (int) iterations.size()) {
+        return;
+    }
+
+    buffers[thread].insert(buffers[thread].end(), { (double) kind, (double) iterations[current], 0.0, (double) thread, begin, end });
+}
+
+void trace_count(int counter, double value) {
+    if (trace_on) {
+        trace_record(counter, trace_now(), value);
+    }
+}
+
+static int write_chrome(const std::string &filename, const std::vector<double> &events, int world_size) {
+    std::filesystem::path dir("outputs");
+    std::filesystem::path pathname = dir / std::filesystem::path(filename);
+
+    if (!std::filesystem::exists(dir)) {
+        mkdir(dir.c_str(), MODE);
+    }
+
+    FILE *fp = fopen(pathname.c_str(), "w");
+    if (fp == NULL) {
+        perror("trace error");
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (int rank = 0; rank < world_size; rank++) {
+        fprintf(fp, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"rank %d\"}},\n", rank, rank);
+    }
+
+    for (size_t i = 0; i < events.size(); i += FIELDS) {
+        const int kind = events[i], iteration = events[i + 1], rank = events[i + 2], thread = events[i + 3];
+        const char *separator = (i + FIELDS < events.size())? ",": "";
+
+        if (kind < TRACE_PHASES) {
+            fprintf(fp, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"iteration\": %d}}%s\n",
+                    kind_names[kind], rank, thread, events[i + 4], events[i + 5] - events[i + 4], iteration, separator);
+        } else {
+            fprintf(fp, "  {\"name\": \"%s\", \"ph\": \"C\", \"pid\": %d, \"ts\": %.3f, \"args\": {\"%s\": %.17g}}%s\n",
+                    kind_names[kind], rank, events[i + 4], kind_names[kind], events[i + 5], separator);
+        }
+    }
+
+    fprintf(fp, "]}\n");
+    fclose(fp);
+
+    return 0;
+}
+
+// Per phase: how many spans, their total and mean over every rank and thread, and the critical time,
+// the busiest rank and thread of every iteration added up, which is what the phase costs the run
+static void print_summary(const std::string &filename, const std::vector<double> &events, int world_size) {
+    long long spans[TRACE_PHASES] = { 0 };
+    double total[TRACE_PHASES] = { 0 }, longest[TRACE_PHASES] = { 0 };
+    std::map<std::tuple<int, int, int, int>, double> busy;
+    int iterations = 0;
+
+    for (size_t i = 0; i < events.size(); i += FIELDS) {
+        const int kind = events[i], iteration = events[i + 1], rank = events[i + 2], thread = events[i + 3];
+        if (kind >= TRACE_PHASES) {
+            continue;
+        }
+
+        const double duration = events[i + 5] - events[i + 4];
+        spans[kind] += 1;
+        total[kind] += duration;
+        longest[kind] = std::max(longest[kind], duration);
+        iterations = std::max(iterations, iteration + 1);
+        busy[std::make_tuple(kind, iteration, rank, thread)] += duration;
+    }
+
+    std::map<std::pair<int, int>, double> slowest;
+    for (const auto &entry : busy) {
+        double &slowest_time = slowest[std::make_pair(std::get<0>(entry.first), std::get<1>(entry.first))];
+        slowest_time = std::max(slowest_time, entry.second);
+    }
+
+    double critical[TRACE_PHASES] = { 0 }, overall = 0;
+    for (const auto &entry : slowest) {
+        critical[entry.first.first] += entry.second;
+        overall += entry.second;
+    }
+
+    printf("Trace of %d iterations on %d ranks written to outputs/%s\n", iterations, world_size, filename.c_str());
+    printf("%-12s %8s %12s %12s %12s %12s %7s\n", "phase", "spans", "total(s)", "mean(ms)", "max(ms)", "critical(s)", "share");
+    for (int kind = 0; kind < TRACE_PHASES; kind++) {
+        if (spans[kind] == 0) {
+            continue;
+        }
+
+        printf("%-12s %8lld %12.6f %12.4f %12.4f %12.6f %6.1f%%\n", kind_names[kind], spans[kind], total[kind] / 1e6,
+               total[kind] / spans[kind] / 1e3, longest[kind] / 1e3, critical[kind] / 1e6,
+               (overall > 0)? 100 * critical[kind] / overall: 0.0);
+    }
+}
+
+// Gather the events of every rank on MASTER, which writes the Chrome trace and prints the summary
+int trace_finish(std::string filename, bool distributed) {
+    trace_on = false;
+
+    int world_size = 1, world_rank = MASTER;
+    if (distributed) {
+        MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+        MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    }
+
+    std::vector<double> local;
+    for (std::vector<double> &buffer : buffers) {
+        for (size_t i = 0; i < buffer.size(); i += FIELDS) {
+            buffer[i + 2] = world_rank;
+        }
+        local.insert(local.end(), buffer.begin(), buffer.end());
+    }
+    buffers.clear();
+
+    std::vector<double> events;
+    if (distributed) {
+        int length = local.size();
+        std::vector<int> lengths(world_size), displacements(world_size, 0);
+        MPI_Gather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+        if (world_rank == MASTER) {
+            for (int rank = 1; rank < world_size; rank++) {
+                displacements[rank] = displacements[rank - 1] + lengths[rank - 1];
+            }
+            events.resize(displacements[world_size - 1] + lengths[world_size - 1]);
+        }
+        MPI_Gatherv(local.data(), length, MPI_DOUBLE, events.data(), lengths.data(), displacements.data(), MPI_DOUBLE, MASTER, MPI_COMM_WORLD);
+    } else {
+        events.swap(local);
+    }
+
+    if (world_rank != MASTER) {
+        return 0;
+    }
+
+    if (write_chrome(filename, events, world_size) == -1) {
+        return -1;
+    }
+
+    print_summary(filename, events, world_size);
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <omp.h>
+#include <time.h>
+#include <string>
+
+// Phases timed per iteration, rank and thread
+#define TRACE_SEED          0
+#define TRACE_ASSIGN        1   // nearest centroids, fused with the per-thread sums
+#define TRACE_REDUCE        2   // folding the thread partials
+#define TRACE_COMMUNICATE   3   // MPI collectives
+#define TRACE_UPDATE        4   // dividing the totals into centroids
+#define TRACE_BOUNDS        5   // loosening the bounds of the pruned engines
+#define TRACE_PHASES        6
+
+// Counters sampled once per iteration and rank
+#define TRACE_CHANGED       TRACE_PHASES
+#define TRACE_INERTIA       (TRACE_PHASES + 1)
+#define TRACE_SHIFT         (TRACE_PHASES + 2)
+#define TRACE_KINDS         (TRACE_PHASES + 3)
+
+extern bool trace_on;
+
+double trace_now();
+void trace_start(bool distributed);
+void trace_iteration(int iteration);
+
+// Restarts running side by side in the teams of the parallel region about to start, each team then tags its
+// spans with its own iteration. Called with false once the region is over.
+void trace_teams(bool on);
+void trace_record(int kind, double begin, double end);
+void trace_count(int counter, double value);
+int trace_finish(std::string filename, bool distributed);
+
+// Times its scope as one span of <phase> on the calling thread, a single branch when tracing is off
+class TraceSpan {
+public:
+    TraceSpan(int phase) : phase(phase), begin(trace_on? trace_now(): 0) {}
+    ~TraceSpan() {
+        if (trace_on) {
+            trace_record(phase, begin, trace_now());
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan &operator=(const TraceSpan&) = delete;
+
+private:
+    int phase;
+    double begin;
+};
+
+#endif